@@ -0,0 +1,25 @@
+QT -= core gui
+
+CONFIG += c++11
+
+TARGET = DeadlockCheckerBenchmark
+CONFIG += console
+CONFIG -= app_bundle qt
+
+TEMPLATE = app
+
+DEFINES += ENABLE_DEADLOCK_CHECK
+
+SOURCES += benchmark.cpp \
+    ./src/DeadlockChecker.cpp \
+    ReadWriteLock.cpp
+
+HEADERS += \
+    ./src/DeadlockChecker.h \
+    ReadWriteLock.h \
+    ./src/CheckerAllocator.h \
+    ./src/FlatHashMap.h \
+    ./src/HolderSet.h \
+    ./src/ThreadIdentity.h \
+    ./src/CheckedMutex.h \
+    ./src/LockHierarchy.h
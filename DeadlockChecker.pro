@@ -18,3 +18,9 @@ SOURCES += test.cpp \
 HEADERS += \
     ./src/DeadlockChecker.h \
     ReadWriteLock.h \
+    ./src/CheckerAllocator.h \
+    ./src/FlatHashMap.h \
+    ./src/HolderSet.h \
+    ./src/ThreadIdentity.h \
+    ./src/CheckedMutex.h \
+    ./src/LockHierarchy.h
@@ -1,10 +1,138 @@
 #include "ReadWriteLock.h"
 #include <assert.h>
+#include <limits.h>
+#include <chrono>
+
+#if defined(__linux__)
+    #include <linux/futex.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #include <immintrin.h>
+#endif
+
+#define SPIN_ROUNDS    10
+#define FAST_READ_LIMIT    8
+#define REBIAS_FACTOR    9
+
+// phase-fair reader counters step by PF_READER_INC, the low bits carry the writer phase
+#define PF_READER_INC    0x100
+#define PF_WRITER_BITS    0x3
+#define PF_WRITER_PRESENT    0x2
+#define PF_PHASE_ID    0x1
+
+namespace
+{
+    inline void cpuRelax()
+    {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+        _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        asm volatile("yield");
+#endif
+    }
+
+    // sleeps while value still equals expected, may return early
+    void park(std::atomic<int>& value, int expected)
+    {
+#if defined(__linux__)
+        syscall(SYS_futex, &value, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+#else
+        (void)value;
+        (void)expected;
+        std::this_thread::yield();
+#endif
+    }
+
+    void wakeWaiters(std::atomic<int>& value, std::atomic<int>& waiters)
+    {
+#if defined(__linux__)
+        if (waiters.load())
+            syscall(SYS_futex, &value, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+        (void)value;
+        (void)waiters;
+#endif
+    }
+
+    // spins with a doubling pause first, then parks until ready(value) holds.
+    // Waiters register before the kernel rechecks value, and every change that
+    // can make a waiter ready is followed by wakeWaiters, so a wakeup can not be lost.
+    template<class Ready>
+    void waitUntil(std::atomic<int>& value, std::atomic<int>& waiters, Ready ready)
+    {
+        for (int round = 0; round < SPIN_ROUNDS; ++round)
+        {
+            if (ready(value.load()))
+                return;
+
+            for (int i = 0; i < (1 << round); ++i)
+                cpuRelax();
+        }
+
+        for (;;)
+        {
+            int v = value.load();
+            if (ready(v))
+                return;
+
+            ++waiters;
+            park(value, v);
+            --waiters;
+        }
+    }
+
+    void waitForZero(std::atomic<int>& value, std::atomic<int>& waiters)
+    {
+        waitUntil(value, waiters, [](int v) { return !v; });
+    }
+
+    void releaseRead(std::atomic<int>& read, std::atomic<int>& readWaiters)
+    {
+        if (!--read)
+            wakeWaiters(read, readWaiters);
+    }
+
+    void lockFlag(std::atomic<int>& flag, std::atomic<int>& waiters)
+    {
+        int v = 0;
+        while (!flag.compare_exchange_strong(v, 1))
+        {
+            waitForZero(flag, waiters);
+            v = 0;
+        }
+    }
+
+    void unlockFlag(std::atomic<int>& flag, std::atomic<int>& waiters)
+    {
+        flag = 0;
+        wakeWaiters(flag, waiters);
+    }
+
+    // biased read locks held by this thread, so readUnlock knows which path was taken
+    struct FastReads
+    {
+        const void* locks[FAST_READ_LIMIT];
+        int count;
+    };
+
+    thread_local FastReads t_fastReads = {{NULL}, 0};
+
+    inline int64_t nowNanoseconds()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+}
 
 RecursiveReadWriteLock::RecursiveReadWriteLock()
     :   m_read(0),
         m_write(0),
-        m_lockedBy(0)
+        m_lockedBy(0),
+        m_intent(0),
+        m_readWaiters(0),
+        m_writeWaiters(0),
+        m_intentWaiters(0)
 {
 
 }
@@ -16,16 +144,16 @@ RecursiveReadWriteLock::~RecursiveReadWriteLock()
 
 void RecursiveReadWriteLock::readLock()
 {
-    ThreadID threadID = getCurrentThreadID();
+    ThreadID threadID = ThreadIdentity::currentID();
     if (threadID != m_lockedBy)
     {
         for (;;)
         {
-            while(m_write.load()){}
+            waitForZero(m_write, m_writeWaiters);
 
             ++m_read;
             if (m_write.load())
-                --m_read;
+                releaseRead(m_read, m_readWaiters);
             else
                 break;
         }
@@ -38,13 +166,13 @@ void RecursiveReadWriteLock::readLock()
 
 bool RecursiveReadWriteLock::tryReadLock()
 {
-    ThreadID threadID = getCurrentThreadID();
+    ThreadID threadID = ThreadIdentity::currentID();
     if (threadID != m_lockedBy)
     {
         ++m_read;
         if (m_write.load())
         {
-            --m_read;
+            releaseRead(m_read, m_readWaiters);
             return false;
         }
     }
@@ -57,20 +185,17 @@ bool RecursiveReadWriteLock::tryReadLock()
 
 void RecursiveReadWriteLock::readUnlock()
 {
-    --m_read;
+    releaseRead(m_read, m_readWaiters);
 }
 
 void RecursiveReadWriteLock::writeLock()
 {
-    ThreadID threadID = getCurrentThreadID();
+    ThreadID threadID = ThreadIdentity::currentID();
     if (threadID != m_lockedBy)
     {
-        int v = 0;
-        while(!m_write.compare_exchange_strong(v, 1))
-        {
-            v = 0;
-        }
-        while (m_read.load()){}
+        lockFlag(m_intent, m_intentWaiters);
+        m_write = 1;
+        waitForZero(m_read, m_readWaiters);
         m_lockedBy = threadID;
     }
     else
@@ -81,16 +206,19 @@ void RecursiveReadWriteLock::writeLock()
 
 bool RecursiveReadWriteLock::tryWriteLock()
 {
-    ThreadID threadID = getCurrentThreadID();
+    ThreadID threadID = ThreadIdentity::currentID();
     if (threadID != m_lockedBy)
     {
         int v = 0;
-        if(!m_write.compare_exchange_strong(v, 1))
+        if(!m_intent.compare_exchange_strong(v, 1))
             return false;
 
+        m_write = 1;
         if (m_read.load())
         {
             m_write = 0;
+            wakeWaiters(m_write, m_writeWaiters);
+            unlockFlag(m_intent, m_intentWaiters);
             return false;
         }
 
@@ -106,26 +234,63 @@ bool RecursiveReadWriteLock::tryWriteLock()
 
 void RecursiveReadWriteLock::writeUnlock()
 {
-    assert(m_lockedBy == getCurrentThreadID());
+    assert(m_lockedBy == ThreadIdentity::currentID());
     readLock();
     if(!--m_write)
+    {
         m_lockedBy = 0;
+        wakeWaiters(m_write, m_writeWaiters);
+        unlockFlag(m_intent, m_intentWaiters);
+    }
     readUnlock();
 }
 
-RecursiveReadWriteLock::ThreadID RecursiveReadWriteLock::getCurrentThreadID()
+void RecursiveReadWriteLock::upgradeableLock()
 {
-#if defined(_WIN32) || defined(_WIN64)
-    return GetCurrentThreadId();
-#else
-    return syscall(SYS_gettid);
-#endif
+    lockFlag(m_intent, m_intentWaiters);
+    readLock();
 }
 
+void RecursiveReadWriteLock::upgradeableUnlock()
+{
+    readUnlock();
+    unlockFlag(m_intent, m_intentWaiters);
+}
 
-ReadWriteLock::ReadWriteLock()
+void RecursiveReadWriteLock::upgrade()
+{
+    // no writer can hold m_write while we own m_intent, only readers are left to drain
+    m_write = 1;
+    releaseRead(m_read, m_readWaiters);
+    waitForZero(m_read, m_readWaiters);
+    m_lockedBy = ThreadIdentity::currentID();
+}
+
+void RecursiveReadWriteLock::downgrade()
+{
+    assert(m_lockedBy == ThreadIdentity::currentID() && m_write.load() == 1);
+
+    // the read is taken before the write goes, so no writer can slip in
+    ++m_read;
+    m_lockedBy = 0;
+    m_write = 0;
+    wakeWaiters(m_write, m_writeWaiters);
+    unlockFlag(m_intent, m_intentWaiters);
+}
+
+
+ReadWriteLock::ReadWriteLock(Policy policy)
     :   m_read(0),
-        m_write(0)
+        m_write(0),
+        m_readWaiters(0),
+        m_writeWaiters(0),
+        m_policy(policy),
+        m_readIn(0),
+        m_readOut(0),
+        m_writeIn(0),
+        m_writeOut(0),
+        m_readInWaiters(0),
+        m_readOutTarget(-1)
 {
 
 }
@@ -137,13 +302,19 @@ ReadWriteLock::~ReadWriteLock()
 
 void ReadWriteLock::readLock()
 {
+    if (m_policy == POLICY_PHASE_FAIR)
+    {
+        phaseFairReadLock();
+        return;
+    }
+
     for (;;)
     {
-        while(m_write.load()){}
+        waitForZero(m_write, m_writeWaiters);
 
         ++m_read;
         if (m_write.load())
-            --m_read;
+            releaseRead(m_read, m_readWaiters);
         else
             break;
     }
@@ -151,10 +322,13 @@ void ReadWriteLock::readLock()
 
 bool ReadWriteLock::tryReadLock()
 {
+    if (m_policy == POLICY_PHASE_FAIR)
+        return phaseFairTryReadLock();
+
     ++m_read;
     if (m_write.load())
     {
-        --m_read;
+        releaseRead(m_read, m_readWaiters);
         return false;
     }
 
@@ -163,21 +337,37 @@ bool ReadWriteLock::tryReadLock()
 
 void ReadWriteLock::readUnlock()
 {
-    --m_read;
+    if (m_policy == POLICY_PHASE_FAIR)
+    {
+        phaseFairReadUnlock();
+        return;
+    }
+
+    releaseRead(m_read, m_readWaiters);
 }
 
 void ReadWriteLock::writeLock()
 {
+    if (m_policy == POLICY_PHASE_FAIR)
+    {
+        phaseFairWriteLock();
+        return;
+    }
+
     int v = 0;
     while(!m_write.compare_exchange_strong(v, 1))
     {
+        waitForZero(m_write, m_writeWaiters);
         v = 0;
     }
-    while (m_read.load()){}
+    waitForZero(m_read, m_readWaiters);
 }
 
 bool ReadWriteLock::tryWriteLock()
 {
+    if (m_policy == POLICY_PHASE_FAIR)
+        return phaseFairTryWriteLock();
+
     int v = 0;
     if(!m_write.compare_exchange_strong(v, 1))
         return false;
@@ -185,6 +375,7 @@ bool ReadWriteLock::tryWriteLock()
     if (m_read.load())
     {
         m_write = 0;
+        wakeWaiters(m_write, m_writeWaiters);
         return false;
     }
 
@@ -193,5 +384,255 @@ bool ReadWriteLock::tryWriteLock()
 
 void ReadWriteLock::writeUnlock()
 {
-    --m_write;
+    if (m_policy == POLICY_PHASE_FAIR)
+    {
+        phaseFairWriteUnlock();
+        return;
+    }
+
+    if (!--m_write)
+        wakeWaiters(m_write, m_writeWaiters);
+}
+
+// Phase-fair ticket lock (PF-T, Brandenburg and Anderson). Readers arriving
+// while a writer is present wait for exactly one writer phase, writers are
+// served in ticket order and wait only for the readers that came before them.
+void ReadWriteLock::phaseFairReadLock()
+{
+    int phase = m_readIn.fetch_add(PF_READER_INC) & PF_WRITER_BITS;
+    if (phase)
+        waitUntil(m_readIn, m_readInWaiters, [phase](int v) { return (v & PF_WRITER_BITS) != phase; });
+}
+
+bool ReadWriteLock::phaseFairTryReadLock()
+{
+    int v = m_readIn.load();
+    do
+    {
+        if (v & PF_WRITER_BITS)
+            return false;
+    } while (!m_readIn.compare_exchange_weak(v, v + PF_READER_INC));
+
+    return true;
+}
+
+void ReadWriteLock::phaseFairReadUnlock()
+{
+    int v = (int)((unsigned)m_readOut.fetch_add(PF_READER_INC) + PF_READER_INC);
+    if (v == m_readOutTarget.load())
+        wakeWaiters(m_readOut, m_readWaiters);
+}
+
+void ReadWriteLock::phaseFairWriteLock()
+{
+    int ticket = m_writeIn.fetch_add(1);
+    waitUntil(m_writeOut, m_writeWaiters, [ticket](int v) { return v == ticket; });
+
+    int readers = m_readIn.fetch_add(PF_WRITER_PRESENT | (ticket & PF_PHASE_ID));
+    m_readOutTarget = readers;
+    waitUntil(m_readOut, m_readWaiters, [readers](int v) { return v == readers; });
+}
+
+bool ReadWriteLock::phaseFairTryWriteLock()
+{
+    int ticket = m_writeOut.load();
+    if (!m_writeIn.compare_exchange_strong(ticket, ticket + 1))
+        return false;
+
+    int readers = m_readIn.fetch_add(PF_WRITER_PRESENT | (ticket & PF_PHASE_ID));
+    if (m_readOut.load() != readers)
+    {
+        // readers that arrived meanwhile are released again by the unlock
+        phaseFairWriteUnlock();
+        return false;
+    }
+
+    return true;
+}
+
+void ReadWriteLock::phaseFairWriteUnlock()
+{
+    m_readIn.fetch_and(~PF_WRITER_BITS);
+    wakeWaiters(m_readIn, m_readInWaiters);
+
+    ++m_writeOut;
+    wakeWaiters(m_writeOut, m_writeWaiters);
+}
+
+
+DistributedReadWriteLock::DistributedReadWriteLock()
+    :   m_bias(true),
+        m_inhibitUntil(0)
+{
+    for (auto& slot : m_slots)
+        slot.count = 0;
+}
+
+DistributedReadWriteLock::~DistributedReadWriteLock()
+{
+
+}
+
+void *DistributedReadWriteLock::operator new(size_t size)
+{
+    return allocateAligned(size);
+}
+
+void *DistributedReadWriteLock::operator new[](size_t size)
+{
+    return allocateAligned(size);
+}
+
+void DistributedReadWriteLock::operator delete(void *p)
+{
+    freeAligned(p);
+}
+
+void DistributedReadWriteLock::operator delete[](void *p)
+{
+    freeAligned(p);
+}
+
+void *DistributedReadWriteLock::allocateAligned(size_t size)
+{
+    // the block as the allocator returned it sits right before the aligned address
+    const size_t alignment = alignof(DistributedReadWriteLock);
+    char* raw = static_cast<char*>(::operator new(size + alignment + sizeof(void*)));
+    uintptr_t aligned = ((uintptr_t)(raw + sizeof(void*)) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    reinterpret_cast<void**>(aligned)[-1] = raw;
+    return reinterpret_cast<void*>(aligned);
+}
+
+void DistributedReadWriteLock::freeAligned(void *p)
+{
+    if (p)
+        ::operator delete(static_cast<void**>(p)[-1]);
+}
+
+void DistributedReadWriteLock::readLock()
+{
+    if (fastReadLock())
+        return;
+
+    m_lock.readLock();
+    rebias();
+}
+
+bool DistributedReadWriteLock::tryReadLock()
+{
+    if (fastReadLock())
+        return true;
+
+    if (!m_lock.tryReadLock())
+        return false;
+
+    rebias();
+    return true;
+}
+
+void DistributedReadWriteLock::readUnlock()
+{
+    FastReads& reads = t_fastReads;
+    for (int i = reads.count - 1; i >= 0; --i)
+    {
+        if (reads.locks[i] == this)
+        {
+            reads.locks[i] = reads.locks[--reads.count];
+            --m_slots[ThreadIdentity::currentIndex() % READER_SLOTS].count;
+            return;
+        }
+    }
+
+    m_lock.readUnlock();
+}
+
+void DistributedReadWriteLock::writeLock()
+{
+    m_lock.writeLock();
+    revokeBias();
+}
+
+bool DistributedReadWriteLock::tryWriteLock()
+{
+    if (!m_lock.tryWriteLock())
+        return false;
+
+    if (m_bias.load(std::memory_order_relaxed))
+    {
+        int64_t start = nowNanoseconds();
+        m_bias = false;
+        if (!isDrained())
+        {
+            m_bias = true;
+            m_lock.writeUnlock();
+            return false;
+        }
+
+        inhibitBias(start);
+    }
+
+    return true;
+}
+
+void DistributedReadWriteLock::writeUnlock()
+{
+    m_lock.writeUnlock();
+}
+
+bool DistributedReadWriteLock::fastReadLock()
+{
+    FastReads& reads = t_fastReads;
+    if (!m_bias.load(std::memory_order_relaxed) || reads.count == FAST_READ_LIMIT)
+        return false;
+
+    // pairs with the writer clearing m_bias before it scans the slots
+    ReaderSlot& slot = m_slots[ThreadIdentity::currentIndex() % READER_SLOTS];
+    ++slot.count;
+    if (!m_bias.load())
+    {
+        --slot.count;
+        return false;
+    }
+
+    reads.locks[reads.count++] = this;
+    return true;
+}
+
+void DistributedReadWriteLock::rebias()
+{
+    // called with the read lock held, so no writer can be revoking at the same time
+    if (!m_bias.load(std::memory_order_relaxed)
+            && nowNanoseconds() >= m_inhibitUntil.load(std::memory_order_relaxed))
+        m_bias = true;
+}
+
+void DistributedReadWriteLock::revokeBias()
+{
+    if (!m_bias.load(std::memory_order_relaxed))
+        return;
+
+    int64_t start = nowNanoseconds();
+    m_bias = false;
+    while (!isDrained())
+        std::this_thread::yield();
+
+    inhibitBias(start);
+}
+
+void DistributedReadWriteLock::inhibitBias(int64_t revokeStart)
+{
+    // keep readers on the slow path for a multiple of what the revocation cost
+    int64_t now = nowNanoseconds();
+    m_inhibitUntil.store(now + (now - revokeStart) * REBIAS_FACTOR, std::memory_order_relaxed);
+}
+
+bool DistributedReadWriteLock::isDrained()
+{
+    for (auto& slot : m_slots)
+    {
+        if (slot.count.load())
+            return false;
+    }
+
+    return true;
 }
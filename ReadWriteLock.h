@@ -3,21 +3,12 @@
 
 #include <atomic>
 #include <thread>
-
-#if defined(_WIN32) || defined(_WIN64)
-    #include <processthreadsapi.h>
-#else
-    #include <sys/syscall.h>
-    #include <unistd.h>
-#endif
+#include <stdint.h>
+#include "src/ThreadIdentity.h"
 
 class RecursiveReadWriteLock
 {
-#if defined(_WIN32) || defined(_WIN64)
-    typedef DWORD ThreadID;
-#else
-    typedef __pid_t ThreadID;
-#endif
+    typedef ThreadIdentity::ThreadID ThreadID;
 
 public:
     RecursiveReadWriteLock();
@@ -30,19 +21,40 @@ public:
     bool tryWriteLock();
     void writeUnlock();
 
-private:
-    inline ThreadID getCurrentThreadID();
+    // a read lock that can later be turned into the write lock in place, only
+    // one thread at a time holds it. Other readers are not blocked.
+    void upgradeableLock();
+    void upgradeableUnlock();
+
+    // upgradeable read -> write, finished with writeUnlock
+    void upgrade();
+    // write -> read without letting a writer in between, finished with readUnlock
+    void downgrade();
 
 private:
     std::atomic<int> m_read;
     std::atomic<int> m_write;
     ThreadID m_lockedBy;
+
+    // held by the writer or the upgradeable reader, so an upgrade never waits for a writer
+    std::atomic<int> m_intent;
+
+    // threads parked on m_read, m_write and m_intent, unlocks skip the wake syscall when 0
+    std::atomic<int> m_readWaiters;
+    std::atomic<int> m_writeWaiters;
+    std::atomic<int> m_intentWaiters;
 };
 
 class ReadWriteLock
 {
 public:
-    ReadWriteLock();
+    enum Policy
+    {
+        POLICY_UNORDERED,   // writers race on a CAS, new readers wait while one is pending
+        POLICY_PHASE_FAIR   // readers and writers alternate, writers queue by ticket
+    };
+
+    explicit ReadWriteLock(Policy policy = POLICY_UNORDERED);
     ~ReadWriteLock();
 
     void readLock();
@@ -52,9 +64,83 @@ public:
     bool tryWriteLock();
     void writeUnlock();
 
+private:
+    inline void phaseFairReadLock();
+    inline bool phaseFairTryReadLock();
+    inline void phaseFairReadUnlock();
+    inline void phaseFairWriteLock();
+    inline bool phaseFairTryWriteLock();
+    inline void phaseFairWriteUnlock();
+
 private:
     std::atomic<int> m_read;
     std::atomic<int> m_write;
+
+    std::atomic<int> m_readWaiters;
+    std::atomic<int> m_writeWaiters;
+
+    // phase-fair state, m_readWaiters and m_writeWaiters count the parkers on
+    // m_readOut and m_writeOut in this mode
+    Policy m_policy;
+    std::atomic<int> m_readIn;
+    std::atomic<int> m_readOut;
+    std::atomic<int> m_writeIn;
+    std::atomic<int> m_writeOut;
+    std::atomic<int> m_readInWaiters;
+
+    // the m_readOut value the waiting writer needs, only the reader that brings
+    // m_readOut there wakes it. Never a multiple of PF_READER_INC while unset
+    std::atomic<int> m_readOutTarget;
 };
 
+// Read-mostly lock. While biased, readers only touch their own padded slot,
+// a writer revokes the bias and waits for the slots to drain. Readers turn
+// the bias back on once writers have been quiet for a while.
+class DistributedReadWriteLock
+{
+public:
+    DistributedReadWriteLock();
+    ~DistributedReadWriteLock();
+
+    // new before C++17 ignores the 64 byte alignment of the slots
+    static void* operator new(size_t size);
+    static void* operator new[](size_t size);
+    static void operator delete(void* p);
+    static void operator delete[](void* p);
+
+    void readLock();
+    bool tryReadLock();
+    void readUnlock();
+    void writeLock();
+    bool tryWriteLock();
+    void writeUnlock();
+
+private:
+    enum { READER_SLOTS = 64 };
+
+    static void* allocateAligned(size_t size);
+    static void freeAligned(void* p);
+
+    // one cache line per slot, so readers on different slots never share a line
+    struct alignas(64) ReaderSlot
+    {
+        std::atomic<int> count;
+    };
+
+    inline bool fastReadLock();
+    inline void rebias();
+    inline void revokeBias();
+    inline void inhibitBias(int64_t revokeStart);
+    inline bool isDrained();
+
+private:
+    std::atomic<bool> m_bias;
+    std::atomic<int64_t> m_inhibitUntil;
+    ReadWriteLock m_lock;
+    ReaderSlot m_slots[READER_SLOTS];
+};
+
+static_assert(sizeof(DistributedReadWriteLock) % 64 == 0 && alignof(DistributedReadWriteLock) == 64,
+              "reader slots must not share cache lines");
+
 #endif //READWRITELock_H
@@ -0,0 +1,670 @@
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+#include <string.h>
+#include <time.h>
+#include "src/DeadlockChecker.h"
+#include "src/CheckedMutex.h"
+#include "src/LockHierarchy.h"
+#include "ReadWriteLock.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void runThreads(int threadNum, const std::function<void(int)>& func)
+{
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadNum; ++i)
+        threads.push_back(std::thread(func, i));
+
+    for (auto& t : threads)
+        t.join();
+}
+
+static size_t stripeContentions()
+{
+    size_t contentions = 0;
+    for (auto& stats : DeadlockChecker::share()->stripeStats())
+        contentions += stats.contentions;
+    return contentions;
+}
+
+// every thread nests two private mutexes, so checks never contend on user locks
+void benchScaling()
+{
+    const int ITERATIONS = 20000;
+
+    printf("%-8s %-12s %-12s %s\n", "threads", "seconds", "checks/sec", "stripe waits");
+    for (int threadNum = 1; threadNum <= 64; threadNum *= 2)
+    {
+        size_t contentions = stripeContentions();
+        Clock::time_point start = Clock::now();
+        runThreads(threadNum, [&](int)
+        {
+            std::string err;
+            std::mutex m1, m2;
+            for (int i = 0; i < ITERATIONS; ++i)
+            {
+                DEADLOCK_CHECK_LOCK(m1, lock, err);
+                DEADLOCK_CHECK_LOCK(m2, lock, err);
+                DEADLOCK_CHECK_UNLOCK(m2, unlock, err);
+                DEADLOCK_CHECK_UNLOCK(m1, unlock, err);
+            }
+        });
+        double seconds = secondsSince(start);
+        double checks = 4.0 * ITERATIONS * threadNum;
+        printf("%-8d %-12.4f %-12.0f %zu\n", threadNum, seconds, checks / seconds, stripeContentions() - contentions);
+    }
+}
+
+// every thread polls one shared mutex, failed attempts leave the checker alone
+void benchTryLock()
+{
+    const int ITERATIONS = 20000;
+
+    std::mutex shared;
+    printf("%-8s %-12s %-12s %s\n", "threads", "seconds", "tries/sec", "acquired");
+    for (int threadNum = 1; threadNum <= 16; threadNum *= 2)
+    {
+        std::atomic<int> acquired(0);
+        Clock::time_point start = Clock::now();
+        runThreads(threadNum, [&](int)
+        {
+            std::string err;
+            for (int i = 0; i < ITERATIONS; ++i)
+            {
+                if (DEADLOCK_CHECK_TRY_LOCK(shared, try_lock, err))
+                {
+                    ++acquired;
+                    DEADLOCK_CHECK_UNLOCK(shared, unlock, err);
+                }
+            }
+        });
+        double seconds = secondsSince(start);
+        printf("%-8d %-12.4f %-12.0f %d\n", threadNum, seconds, ITERATIONS * threadNum / seconds, acquired.load());
+    }
+}
+
+// short-lived threads in small batches, the checker only keeps state for the live ones
+void benchChurn()
+{
+    const int ROUNDS = 5;
+    const int BATCHES = 500;
+    const int BATCH_SIZE = 4;
+
+    std::mutex shared;
+    printf("%-8s %-12s %-12s %-12s %s\n", "round", "seconds", "threads/sec", "allocations", "indexes");
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+        size_t allocations = DeadlockChecker::allocationCount();
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < BATCHES; ++i)
+        {
+            runThreads(BATCH_SIZE, [&](int)
+            {
+                std::string err;
+                std::mutex own;
+                DEADLOCK_CHECK_LOCK(own, lock, err);
+                DEADLOCK_CHECK_LOCK(shared, lock, err);
+                DEADLOCK_CHECK_UNLOCK(shared, unlock, err);
+                DEADLOCK_CHECK_UNLOCK(own, unlock, err);
+            });
+        }
+        double seconds = secondsSince(start);
+        printf("%-8d %-12.4f %-12.0f %-12zu %u\n", round, seconds, BATCHES * BATCH_SIZE / seconds,
+               DeadlockChecker::allocationCount() - allocations, ThreadIdentity::count());
+    }
+}
+
+// one thread keeps 10k locks held while it cycles through another 10k
+void benchLiveLocks()
+{
+    const int LIVE_LOCKS = 10000;
+    const int ROUNDS = 20;
+
+    std::unique_ptr<std::mutex[]> held(new std::mutex[LIVE_LOCKS]);
+    std::unique_ptr<std::mutex[]> cycled(new std::mutex[LIVE_LOCKS]);
+    std::string err;
+
+    for (int i = 0; i < LIVE_LOCKS; ++i)
+        DEADLOCK_CHECK_LOCK(held[i], lock, err);
+
+    Clock::time_point start = Clock::now();
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+        for (int i = 0; i < LIVE_LOCKS; ++i)
+        {
+            DEADLOCK_CHECK_LOCK(cycled[i], lock, err);
+            DEADLOCK_CHECK_UNLOCK(cycled[i], unlock, err);
+        }
+    }
+    double seconds = secondsSince(start);
+    double checks = 2.0 * LIVE_LOCKS * ROUNDS;
+    printf("%d live locks: %.1f ns/check\n", LIVE_LOCKS, seconds * 1e9 / checks);
+
+    for (int i = 0; i < LIVE_LOCKS; ++i)
+        DEADLOCK_CHECK_UNLOCK(held[i], unlock, err);
+}
+
+// what a blocking acquisition pays for publishing its wait, and a scan over many threads
+void benchWatchdog()
+{
+    const int ITERATIONS = 200000;
+    const int THREADS = 8;
+
+    printf("%-10s %-12s %s\n", "watchdog", "seconds", "ns/pair");
+    for (int enabled = 0; enabled < 2; ++enabled)
+    {
+        DeadlockChecker::share()->setWatchdog(enabled != 0, 1);
+        Clock::time_point start = Clock::now();
+        runThreads(THREADS, [&](int)
+        {
+            std::mutex own;
+            std::string err;
+            for (int i = 0; i < ITERATIONS / THREADS; ++i)
+            {
+                DEADLOCK_CHECK_LOCK(own, lock, err);
+                DEADLOCK_CHECK_UNLOCK(own, unlock, err);
+            }
+        });
+        double seconds = secondsSince(start);
+        printf("%-10s %-12.4f %.1f\n", enabled ? "on" : "off", seconds, seconds * 1e9 / ITERATIONS);
+    }
+    DeadlockChecker::share()->setWatchdog(false);
+}
+
+// cost of timing every blocking acquisition, and the report it produces for a shared lock
+void benchProfiling()
+{
+    const int ITERATIONS = 200000;
+    const int THREADS = 8;
+
+    std::mutex shared;
+    printf("%-10s %-12s %s\n", "profiling", "seconds", "ns/pair");
+    for (int enabled = 0; enabled < 2; ++enabled)
+    {
+        DeadlockChecker::share()->setProfiling(enabled != 0);
+        Clock::time_point start = Clock::now();
+        runThreads(THREADS, [&](int)
+        {
+            std::string err;
+            for (int i = 0; i < ITERATIONS / THREADS; ++i)
+            {
+                DEADLOCK_CHECK_LOCK(shared, lock, err);
+                DEADLOCK_CHECK_UNLOCK(shared, unlock, err);
+            }
+        });
+        double seconds = secondsSince(start);
+        printf("%-10s %-12.4f %.1f\n", enabled ? "on" : "off", seconds, seconds * 1e9 / ITERATIONS);
+    }
+    DeadlockChecker::share()->setProfiling(false);
+
+    printf("%s", DeadlockChecker::share()->contentionProfile().toString(3).c_str());
+}
+
+// cost of timing every hold under full load, each thread cycling its own locks
+void benchHolds()
+{
+    const int ITERATIONS = 400000;
+    const int THREADS = 8;
+
+    printf("%-10s %-12s %s\n", "tracking", "seconds", "ns/pair");
+    for (int enabled = 0; enabled < 2; ++enabled)
+    {
+        DeadlockChecker::share()->setHoldTracking(enabled != 0, 1000000);
+        Clock::time_point start = Clock::now();
+        runThreads(THREADS, [&](int)
+        {
+            std::mutex outer, inner;
+            std::string err;
+            for (int i = 0; i < ITERATIONS / THREADS / 2; ++i)
+            {
+                DEADLOCK_CHECK_LOCK(outer, lock, err);
+                DEADLOCK_CHECK_LOCK(inner, lock, err);
+                DEADLOCK_CHECK_UNLOCK(inner, unlock, err);
+                DEADLOCK_CHECK_UNLOCK(outer, unlock, err);
+            }
+        });
+        double seconds = secondsSince(start);
+        printf("%-10s %-12.4f %.1f\n", enabled ? "on" : "off", seconds, seconds * 1e9 / ITERATIONS);
+    }
+    DeadlockChecker::share()->setHoldTracking(false);
+}
+
+// inline cost of the macros when events are only queued for the analyzer
+void benchAsync()
+{
+    const int ITERATIONS = 1000000;
+
+    for (int async = 0; async < 2; ++async)
+    {
+        DeadlockChecker::share()->setAsyncMode(async);
+
+        std::string err;
+        std::mutex m1, m2;
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < ITERATIONS; ++i)
+        {
+            DEADLOCK_CHECK_LOCK(m1, lock, err);
+            DEADLOCK_CHECK_LOCK(m2, lock, err);
+            DEADLOCK_CHECK_UNLOCK(m2, unlock, err);
+            DEADLOCK_CHECK_UNLOCK(m1, unlock, err);
+        }
+        double seconds = secondsSince(start);
+        size_t stalls = DeadlockChecker::share()->asyncStalls();
+        DeadlockChecker::share()->setAsyncMode(false);
+
+        printf("%-8s %.1f ns/check, %zu stalls\n", async ? "async" : "inline",
+               seconds * 1e9 / (4.0 * ITERATIONS), stalls);
+    }
+}
+
+// cost of the macros switched off at runtime, against the calls DIRECT_LOCK expands to
+void benchDisabled()
+{
+    const int ITERATIONS = 10000000;
+
+    std::string err;
+    std::mutex m1, m2;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i)
+    {
+        m1.lock();
+        m2.lock();
+        m2.unlock();
+        m1.unlock();
+    }
+    double direct = secondsSince(start);
+
+    DeadlockChecker::setEnabled(false);
+    start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i)
+    {
+        DEADLOCK_CHECK_LOCK(m1, lock, err);
+        DEADLOCK_CHECK_LOCK(m2, lock, err);
+        DEADLOCK_CHECK_UNLOCK(m2, unlock, err);
+        DEADLOCK_CHECK_UNLOCK(m1, unlock, err);
+    }
+    double disabled = secondsSince(start);
+    DeadlockChecker::setEnabled(true);
+
+    printf("%-10s %.2f ns/op\n", "direct", direct * 1e9 / (4.0 * ITERATIONS));
+    printf("%-10s %.2f ns/op\n", "disabled", disabled * 1e9 / (4.0 * ITERATIONS));
+}
+
+// the wrappers against the raw mutex and the macros. Compiled without
+// ENABLE_DEADLOCK_CHECK they are the raw mutex, sizeof is checked in the header
+void benchWrappers()
+{
+    const int ITERATIONS = 2000000;
+
+    std::string err;
+    std::mutex m1, m2;
+    CheckedMutex<std::mutex> c1, c2;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i)
+    {
+        std::lock_guard<std::mutex> g1(m1);
+        std::lock_guard<std::mutex> g2(m2);
+    }
+    double direct = secondsSince(start);
+
+    DeadlockChecker::setEnabled(false);
+    start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i)
+    {
+        std::lock_guard<CheckedMutex<std::mutex>> g1(c1);
+        std::lock_guard<CheckedMutex<std::mutex>> g2(c2);
+    }
+    double disabled = secondsSince(start);
+    DeadlockChecker::setEnabled(true);
+
+    start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i)
+    {
+        DEADLOCK_CHECK_GUARD(g1, c1);
+        DEADLOCK_CHECK_GUARD(g2, c2);
+    }
+    double checked = secondsSince(start);
+
+    start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i)
+    {
+        DEADLOCK_CHECK_LOCK(m1, lock, err);
+        DEADLOCK_CHECK_LOCK(m2, lock, err);
+        DEADLOCK_CHECK_UNLOCK(m2, unlock, err);
+        DEADLOCK_CHECK_UNLOCK(m1, unlock, err);
+    }
+    double macros = secondsSince(start);
+
+    printf("sizeof mutex %zu, sizeof CheckedMutex %zu\n", sizeof(std::mutex), sizeof(CheckedMutex<std::mutex>));
+    printf("%-10s %.2f ns/op\n", "direct", direct * 1e9 / (4.0 * ITERATIONS));
+    printf("%-10s %.2f ns/op\n", "disabled", disabled * 1e9 / (4.0 * ITERATIONS));
+    printf("%-10s %.2f ns/op\n", "checked", checked * 1e9 / (4.0 * ITERATIONS));
+    printf("%-10s %.2f ns/op\n", "macros", macros * 1e9 / (4.0 * ITERATIONS));
+}
+
+// a leveled pair against the raw mutex and the full check of the same pair
+void benchLevels()
+{
+    const int ITERATIONS = 2000000;
+
+    std::string err;
+    std::mutex m1, m2;
+    LeveledMutex<std::mutex, 1> l1;
+    LeveledMutex<std::mutex, 2> l2;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i)
+    {
+        std::lock_guard<std::mutex> g1(m1);
+        std::lock_guard<std::mutex> g2(m2);
+    }
+    double direct = secondsSince(start);
+
+    start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i)
+    {
+        LevelGuard<LeveledMutex<std::mutex, 1>> g1(l1);
+        LevelGuard<LeveledMutex<std::mutex, 2>> g2(l2, g1);
+    }
+    double leveled = secondsSince(start);
+
+    start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i)
+    {
+        DEADLOCK_CHECK_LOCK(m1, lock, err);
+        DEADLOCK_CHECK_LOCK(m2, lock, err);
+        DEADLOCK_CHECK_UNLOCK(m2, unlock, err);
+        DEADLOCK_CHECK_UNLOCK(m1, unlock, err);
+    }
+    double checked = secondsSince(start);
+
+    printf("%-10s %.2f ns/op\n", "direct", direct * 1e9 / (4.0 * ITERATIONS));
+    printf("%-10s %.2f ns/op\n", "leveled", leveled * 1e9 / (4.0 * ITERATIONS));
+    printf("%-10s %.2f ns/op\n", "checked", checked * 1e9 / (4.0 * ITERATIONS));
+}
+
+// the busy-wait ReadWriteLock before parking was added, kept as the baseline
+class SpinReadWriteLock
+{
+public:
+    SpinReadWriteLock() : m_read(0), m_write(0) {}
+
+    void readLock()
+    {
+        for (;;)
+        {
+            while(m_write.load()){}
+
+            ++m_read;
+            if (m_write.load())
+                --m_read;
+            else
+                break;
+        }
+    }
+
+    void readUnlock() { --m_read; }
+
+    void writeLock()
+    {
+        int v = 0;
+        while(!m_write.compare_exchange_strong(v, 1))
+        {
+            v = 0;
+        }
+        while (m_read.load()){}
+    }
+
+    void writeUnlock() { --m_write; }
+
+private:
+    std::atomic<int> m_read;
+    std::atomic<int> m_write;
+};
+
+// more threads than cores, one acquisition in 8 is a writer holding the lock for a while
+template<class RWLock>
+static void runOversubscribed(const char* name)
+{
+    const int ITERATIONS = 400;
+    int threadNum = 4 * std::max(1u, std::thread::hardware_concurrency());
+
+    RWLock lock;
+    std::atomic<int> shared(0);
+    clock_t cpuStart = clock();
+    Clock::time_point start = Clock::now();
+    runThreads(threadNum, [&](int index)
+    {
+        for (int i = 0; i < ITERATIONS; ++i)
+        {
+            if ((i + index) % 8 == 0)
+            {
+                lock.writeLock();
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+                ++shared;
+                lock.writeUnlock();
+            }
+            else
+            {
+                lock.readLock();
+                shared.load();
+                lock.readUnlock();
+            }
+        }
+    });
+    double seconds = secondsSince(start);
+    double cpuSeconds = double(clock() - cpuStart) / CLOCKS_PER_SEC;
+
+    printf("%-8s %d threads: %.3f s wall, %.3f s cpu, %.0f ops/sec\n", name, threadNum, seconds, cpuSeconds,
+           ITERATIONS * threadNum / seconds);
+}
+
+void benchParking()
+{
+    runOversubscribed<SpinReadWriteLock>("spin");
+    runOversubscribed<ReadWriteLock>("parking");
+}
+
+template<class RWLock>
+static void runReaders(const char* name, int threadNum)
+{
+    const int ITERATIONS = 1000000;
+
+    RWLock lock;
+    Clock::time_point start = Clock::now();
+    runThreads(threadNum, [&](int)
+    {
+        for (int i = 0; i < ITERATIONS; ++i)
+        {
+            lock.readLock();
+            lock.readUnlock();
+        }
+    });
+    double seconds = secondsSince(start);
+
+    printf("%-12s %-8d %.0f reads/sec\n", name, threadNum, ITERATIONS * threadNum / seconds);
+}
+
+// read-only workload, the shared counter against per-thread slots
+void benchReaders()
+{
+    int maxThreads = 2 * std::max(1u, std::thread::hardware_concurrency());
+    for (int threadNum = 1; threadNum <= maxThreads; threadNum *= 2)
+    {
+        runReaders<ReadWriteLock>("shared", threadNum);
+        runReaders<DistributedReadWriteLock>("distributed", threadNum);
+    }
+}
+
+// log2 buckets of nanoseconds
+struct LatencyHistogram
+{
+    size_t buckets[64];
+    size_t count;
+
+    LatencyHistogram() : count(0) { memset(buckets, 0, sizeof(buckets)); }
+
+    void add(int64_t ns)
+    {
+        int bucket = 0;
+        while (bucket < 63 && (int64_t(1) << (bucket + 1)) <= ns)
+            ++bucket;
+        ++buckets[bucket];
+        ++count;
+    }
+
+    void merge(const LatencyHistogram& other)
+    {
+        for (int i = 0; i < 64; ++i)
+            buckets[i] += other.buckets[i];
+        count += other.count;
+    }
+
+    // upper bound of the bucket holding the given quantile
+    int64_t percentile(double q) const
+    {
+        size_t rank = size_t(q * count);
+        size_t seen = 0;
+        for (int i = 0; i < 64; ++i)
+        {
+            seen += buckets[i];
+            if (seen > rank)
+                return int64_t(1) << (i + 1);
+        }
+        return 0;
+    }
+};
+
+static void runMixed(const char* name, ReadWriteLock::Policy policy)
+{
+    const int ITERATIONS = 20000;
+    const int THREADS = 8;
+
+    ReadWriteLock lock(policy);
+    std::vector<LatencyHistogram> reads(THREADS), writes(THREADS);
+    runThreads(THREADS, [&](int index)
+    {
+        for (int i = 0; i < ITERATIONS; ++i)
+        {
+            bool write = (i + index) % 10 == 0;
+            Clock::time_point start = Clock::now();
+            if (write)
+                lock.writeLock();
+            else
+                lock.readLock();
+            int64_t waited = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+            // a little work inside the critical section
+            for (volatile int spin = 0; spin < 200; ++spin) {}
+
+            if (write)
+            {
+                lock.writeUnlock();
+                writes[index].add(waited);
+            }
+            else
+            {
+                lock.readUnlock();
+                reads[index].add(waited);
+            }
+        }
+    });
+
+    LatencyHistogram read, write;
+    for (int i = 0; i < THREADS; ++i)
+    {
+        read.merge(reads[i]);
+        write.merge(writes[i]);
+    }
+
+    printf("%-11s %-6s p50 %-9lld p99 %-9lld p99.9 %-9lld ns\n", name, "read", (long long)read.percentile(0.5),
+           (long long)read.percentile(0.99), (long long)read.percentile(0.999));
+    printf("%-11s %-6s p50 %-9lld p99 %-9lld p99.9 %-9lld ns\n", name, "write", (long long)write.percentile(0.5),
+           (long long)write.percentile(0.99), (long long)write.percentile(0.999));
+}
+
+// acquisition latency of a 90/10 read/write mix under each policy
+void benchFairness()
+{
+    runMixed("unordered", ReadWriteLock::POLICY_UNORDERED);
+    runMixed("phase-fair", ReadWriteLock::POLICY_PHASE_FAIR);
+}
+
+// uncontended RecursiveReadWriteLock, every operation needs the caller's thread id
+void benchRecursive()
+{
+    const int ITERATIONS = 2000000;
+
+    RecursiveReadWriteLock lock;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i)
+    {
+        lock.readLock();
+        lock.readUnlock();
+    }
+    double read = secondsSince(start);
+
+    start = Clock::now();
+    for (int i = 0; i < ITERATIONS; ++i)
+    {
+        lock.writeLock();
+        lock.writeLock();
+        lock.writeUnlock();
+        lock.writeUnlock();
+    }
+    double write = secondsSince(start);
+
+    printf("%-18s %.1f ns/op\n", "read lock+unlock", read * 1e9 / ITERATIONS);
+    printf("%-18s %.1f ns/op\n", "nested write pair", write * 1e9 / ITERATIONS);
+}
+
+int main(int argc, char *argv[])
+{
+    DeadlockChecker::init();
+
+    struct
+    {
+        const char* name;
+        std::function<void()> func;
+    } benches[] = {
+        {"scaling", benchScaling},
+        {"try-lock", benchTryLock},
+        {"live-locks", benchLiveLocks},
+        {"churn", benchChurn},
+        {"watchdog", benchWatchdog},
+        {"profiling", benchProfiling},
+        {"holds", benchHolds},
+        {"async", benchAsync},
+        {"disabled", benchDisabled},
+        {"wrappers", benchWrappers},
+        {"levels", benchLevels},
+        {"parking", benchParking},
+        {"readers", benchReaders},
+        {"fairness", benchFairness},
+        {"recursive", benchRecursive},
+    };
+
+    for (auto& bench : benches)
+    {
+        if (argc > 1 && strcmp(argv[1], bench.name))
+            continue;
+
+        printf("bench %s :\n", bench.name);
+        bench.func();
+        printf("\n");
+    }
+
+    DeadlockChecker::release();
+
+    return 0;
+}
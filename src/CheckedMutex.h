@@ -0,0 +1,228 @@
+#ifndef CHECKEDMUTEX_H
+#define CHECKEDMUTEX_H
+
+#include <mutex>
+#include <type_traits>
+#if __cplusplus >= 201402L
+#include <shared_mutex>
+#endif
+#include "DeadlockChecker.h"
+
+// Lockable wrappers that go through the checker, usable with std::lock_guard,
+// std::unique_lock and std::lock. Calls without a site are reported as
+// CheckedMutex:0, the guard macros and DEADLOCK_CHECK_HERE give the call line.
+// A failed check never stops the real call, it goes to the report callback.
+// Without ENABLE_DEADLOCK_CHECK the wrappers are the wrapped types themselves.
+
+// shared counterpart of std::lock_guard, C++11 has no std::shared_lock
+template<class M>
+class SharedLockGuard
+{
+public:
+    explicit SharedLockGuard(M& mutex) : m_mutex(mutex) { m_mutex.lock_shared(); }
+    ~SharedLockGuard() { m_mutex.unlock_shared(); }
+
+    SharedLockGuard(const SharedLockGuard&) = delete;
+    SharedLockGuard& operator=(const SharedLockGuard&) = delete;
+
+private:
+    M& m_mutex;
+};
+
+#ifdef ENABLE_DEADLOCK_CHECK
+
+// one static site per template instantiation and kind, for calls that pass none
+template<class M, int Kind>
+struct CheckedDefaultSite
+{
+    static const DeadlockChecker::SourceSite* get()
+    {
+        static const DeadlockChecker::SourceSite site = {"CheckedMutex", 0, "", Kind, &typeid(M)};
+        return &site;
+    }
+};
+
+template<class M, int Kind>
+class CheckedLockable
+{
+public:
+    typedef CheckedDefaultSite<M, Kind> DefaultSite;
+    enum { SITE_KIND = Kind };
+
+    CheckedLockable() {}
+
+    // the address may be reused by another lock, which must not inherit its order edges
+    ~CheckedLockable()
+    {
+        DEADLOCK_CHECK_DESTROY(m_mutex);
+    }
+
+    CheckedLockable(const CheckedLockable&) = delete;
+    CheckedLockable& operator=(const CheckedLockable&) = delete;
+
+    void lock(const DeadlockChecker::SourceSite* site = DefaultSite::get())
+    {
+        if (!DeadlockChecker::isEnabled())
+        {
+            m_mutex.lock();
+            return;
+        }
+
+        DeadlockChecker::share()->lockChecked(&m_mutex, site);
+        DeadlockChecker::WaitScope wait(&m_mutex, site);
+        m_mutex.lock();
+    }
+
+    bool try_lock(const DeadlockChecker::SourceSite* site = CheckedDefaultSite<M, Kind | DeadlockChecker::SITE_TRY>::get())
+    {
+        bool ret = m_mutex.try_lock();
+        if (DeadlockChecker::isEnabled())
+            DeadlockChecker::share()->tryLockChecked(&m_mutex, site, ret);
+        return ret;
+    }
+
+    void unlock(const DeadlockChecker::SourceSite* site = DefaultSite::get())
+    {
+        if (DeadlockChecker::isEnabled())
+            DeadlockChecker::share()->unlockChecked(&m_mutex, site);
+        m_mutex.unlock();
+    }
+
+    M& native() { return m_mutex; }
+
+protected:
+    M m_mutex;
+};
+
+template<class M>
+class CheckedMutex : public CheckedLockable<M, DeadlockChecker::SITE_LOCK>
+{
+};
+
+template<class M>
+class CheckedRecursiveMutex : public CheckedLockable<M, DeadlockChecker::SITE_RECURSIVE>
+{
+};
+
+// M needs lock_shared, try_lock_shared and unlock_shared. The exclusive side is
+// tracked as the write lock and the shared side as the read lock
+template<class M>
+class CheckedSharedMutex : public CheckedLockable<M, DeadlockChecker::SITE_WRITE>
+{
+public:
+    typedef CheckedDefaultSite<M, DeadlockChecker::SITE_READ> DefaultSharedSite;
+
+    // the standard shared mutexes came after C++11, so check whichever M is used
+    CheckedSharedMutex()
+    {
+        static_assert(sizeof(CheckedSharedMutex) == sizeof(M), "CheckedSharedMutex must not grow the mutex");
+    }
+
+    void lock_shared(const DeadlockChecker::SourceSite* site = DefaultSharedSite::get())
+    {
+        if (!DeadlockChecker::isEnabled())
+        {
+            this->m_mutex.lock_shared();
+            return;
+        }
+
+        DeadlockChecker::share()->lockChecked(&this->m_mutex, site);
+        DeadlockChecker::WaitScope wait(&this->m_mutex, site);
+        this->m_mutex.lock_shared();
+    }
+
+    bool try_lock_shared(const DeadlockChecker::SourceSite* site =
+            CheckedDefaultSite<M, DeadlockChecker::SITE_READ | DeadlockChecker::SITE_TRY>::get())
+    {
+        bool ret = this->m_mutex.try_lock_shared();
+        if (DeadlockChecker::isEnabled())
+            DeadlockChecker::share()->tryLockChecked(&this->m_mutex, site, ret);
+        return ret;
+    }
+
+    void unlock_shared(const DeadlockChecker::SourceSite* site = DefaultSharedSite::get())
+    {
+        if (DeadlockChecker::isEnabled())
+            DeadlockChecker::share()->unlockChecked(&this->m_mutex, site);
+        this->m_mutex.unlock_shared();
+    }
+};
+
+// the guards keep the site of the macro that made them for the unlock as well
+template<class M>
+class CheckedLockGuard
+{
+public:
+    CheckedLockGuard(M& mutex, const DeadlockChecker::SourceSite* site) : m_mutex(mutex), m_site(site)
+    {
+        m_mutex.lock(m_site);
+    }
+    ~CheckedLockGuard() { m_mutex.unlock(m_site); }
+
+    CheckedLockGuard(const CheckedLockGuard&) = delete;
+    CheckedLockGuard& operator=(const CheckedLockGuard&) = delete;
+
+private:
+    M& m_mutex;
+    const DeadlockChecker::SourceSite* m_site;
+};
+
+template<class M>
+class CheckedSharedLockGuard
+{
+public:
+    CheckedSharedLockGuard(M& mutex, const DeadlockChecker::SourceSite* site) : m_mutex(mutex), m_site(site)
+    {
+        m_mutex.lock_shared(m_site);
+    }
+    ~CheckedSharedLockGuard() { m_mutex.unlock_shared(m_site); }
+
+    CheckedSharedLockGuard(const CheckedSharedLockGuard&) = delete;
+    CheckedSharedLockGuard& operator=(const CheckedSharedLockGuard&) = delete;
+
+private:
+    M& m_mutex;
+    const DeadlockChecker::SourceSite* m_site;
+};
+
+// a static site for the current line, for the explicit-site overloads of the checked build
+#define DEADLOCK_CHECK_HERE(__mutex, __kind) \
+    ([]() -> const DeadlockChecker::SourceSite* \
+    { \
+        static const DeadlockChecker::SourceSite site = {__FILE__, __LINE__, "", __kind, \
+                                                         &typeid(std::remove_reference<decltype((__mutex).native())>::type)}; \
+        return &site; \
+    }())
+
+#define DEADLOCK_CHECK_GUARD(__guard, __mutex) \
+    CheckedLockGuard<std::remove_reference<decltype(__mutex)>::type> __guard(__mutex, \
+        DEADLOCK_CHECK_HERE(__mutex, std::remove_reference<decltype(__mutex)>::type::SITE_KIND))
+
+#define DEADLOCK_CHECK_SHARED_GUARD(__guard, __mutex) \
+    CheckedSharedLockGuard<std::remove_reference<decltype(__mutex)>::type> __guard(__mutex, \
+        DEADLOCK_CHECK_HERE(__mutex, DeadlockChecker::SITE_READ))
+
+#else
+
+template<class M> using CheckedMutex = M;
+template<class M> using CheckedRecursiveMutex = M;
+template<class M> using CheckedSharedMutex = M;
+
+#define DEADLOCK_CHECK_GUARD(__guard, __mutex) \
+    std::lock_guard<std::remove_reference<decltype(__mutex)>::type> __guard(__mutex)
+
+#define DEADLOCK_CHECK_SHARED_GUARD(__guard, __mutex) \
+    SharedLockGuard<std::remove_reference<decltype(__mutex)>::type> __guard(__mutex)
+
+#endif // ENABLE_DEADLOCK_CHECK
+
+// the wrappers add no state of their own
+static_assert(sizeof(CheckedMutex<std::mutex>) == sizeof(std::mutex), "CheckedMutex must not grow the mutex");
+static_assert(sizeof(CheckedRecursiveMutex<std::recursive_mutex>) == sizeof(std::recursive_mutex),
+              "CheckedRecursiveMutex must not grow the mutex");
+#if __cplusplus >= 201402L
+static_assert(sizeof(CheckedSharedMutex<std::shared_timed_mutex>) == sizeof(std::shared_timed_mutex),
+              "CheckedSharedMutex must not grow the mutex");
+#endif
+
+#endif // CHECKEDMUTEX_H
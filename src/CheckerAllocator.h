@@ -0,0 +1,49 @@
+#ifndef CHECKERALLOCATOR_H
+#define CHECKERALLOCATOR_H
+
+#include <atomic>
+#include <new>
+#include <stddef.h>
+
+// Counts the heap blocks the checker takes for its own bookkeeping, so a
+// test can prove the steady state check path never reaches malloc.
+class CheckerAllocations
+{
+public:
+    static size_t count() { return counter().load(std::memory_order_relaxed); }
+    static void add() { counter().fetch_add(1, std::memory_order_relaxed); }
+
+private:
+    static std::atomic<size_t>& counter()
+    {
+        static std::atomic<size_t> counter(0);
+        return counter;
+    }
+};
+
+// std allocator that goes through the counter
+template<class T>
+class CheckerAllocator
+{
+public:
+    typedef T value_type;
+
+    CheckerAllocator() {}
+    template<class U> CheckerAllocator(const CheckerAllocator<U>&) {}
+
+    T* allocate(size_t n)
+    {
+        CheckerAllocations::add();
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t)
+    {
+        ::operator delete(p);
+    }
+
+    template<class U> bool operator==(const CheckerAllocator<U>&) const { return true; }
+    template<class U> bool operator!=(const CheckerAllocator<U>&) const { return false; }
+};
+
+#endif // CHECKERALLOCATOR_H
@@ -1,8 +1,23 @@
 #include "DeadlockChecker.h"
 #include <vector>
+#include <deque>
+#include <algorithm>
+#include <tuple>
+#include <chrono>
+#include <stdio.h>
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
 
 #define ERR_CHECK_FUNC_NOT_MATCHING "check func not matching"
 #define ERR_UNLOCK_AN_INVALID_LOCK "unlock an invalid lock"
+#define ERR_LOCK_ORDER_INVERSION "lock order inversion"
+#define ERR_THREAD_EXIT_HOLDING_LOCKS "thread exited while holding locks"
+#define ERR_WAIT_CYCLE "waits-for cycle"
+#define ERR_STALL "lock wait stalled"
+#define ERR_LONG_HOLD "lock held too long"
+#define ERR_LEVEL_INVERSION "lock level inversion"
 
 #define FLAG_DEFAULT   1
 #define FLAG_READ   2
@@ -13,223 +28,2175 @@
 #define INDEX_COUNT_READ    2
 #define INDEX_COUNT_WRITE   3
 
-#define MAX_PATH_LEN    50
+#define DEFAULT_HISTORY_DEPTH    50
+#define EVENT_QUEUE_SIZE    4096
+#define KNOWN_ORDER_LIMIT    4096
+#define ANALYZER_INTERVAL_MS    1
+
+DeadlockChecker* DeadlockChecker::s_this = NULL;
+unsigned DeadlockChecker::s_generation = 0;
+std::atomic<bool> DeadlockChecker::s_enabled(true);
+std::atomic<bool> DeadlockChecker::s_watching(false);
+std::atomic<bool> DeadlockChecker::s_profiling(false);
+
+namespace
+{
+    struct CurrentLockPath
+    {
+        void* path;
+        unsigned generation;
+    };
+
+    thread_local CurrentLockPath t_currentLockPath = {NULL, 0};
+
+    inline unsigned lowestBit(uint64_t mask)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward64(&index, mask);
+        return index;
+#else
+        return __builtin_ctzll(mask);
+#endif
+    }
+
+    inline unsigned highestBit(uint64_t mask)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanReverse64(&index, mask);
+        return index;
+#else
+        return 63 - __builtin_clzll(mask);
+#endif
+    }
+
+    inline int flagOfSite(const DeadlockChecker::SourceSite* site)
+    {
+        if (site->kind & DeadlockChecker::SITE_READ)
+            return FLAG_READ;
+        if (site->kind & DeadlockChecker::SITE_WRITE)
+            return FLAG_WRITE;
+        return FLAG_DEFAULT;
+    }
+
+    inline unsigned& countOfHolder(HolderSet::Holder& holder, int flagLock)
+    {
+        return flagLock == FLAG_READ ? holder.shared : holder.exclusive;
+    }
+
+    int64_t nowNanoseconds()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    bool longerTime(const DeadlockChecker::ContentionProfile::Entry& a, const DeadlockChecker::ContentionProfile::Entry& b)
+    {
+        return a.waitNanoseconds != b.waitNanoseconds ? a.waitNanoseconds > b.waitNanoseconds
+                                                      : a.tryFailures > b.tryFailures;
+    }
+
+    // every cycle is found once, from the node that closes it
+    void findCycles(const std::vector<std::vector<size_t>>& edges, size_t node, std::vector<int>& state,
+                    std::vector<size_t>& stack, std::vector<std::vector<size_t>>& cycles)
+    {
+        state[node] = 1;
+        stack.push_back(node);
+        for (size_t next : edges[node])
+        {
+            if (state[next] == 1)
+                cycles.push_back(std::vector<size_t>(std::find(stack.begin(), stack.end(), next), stack.end()));
+            else if (!state[next])
+                findCycles(edges, next, state, stack, cycles);
+        }
+        stack.pop_back();
+        state[node] = 2;
+    }
+
+    std::string jsonOfString(const std::string& str)
+    {
+        std::string ret = "\"";
+        for (char c : str)
+        {
+            if (c == '"' || c == '\\')
+            {
+                ret.push_back('\\');
+                ret.push_back(c);
+            }
+            else if ((unsigned char)c < 0x20)
+            {
+                char buf[8] = {0};
+                sprintf(buf, "\\u%04x", c);
+                ret.append(buf);
+            }
+            else
+            {
+                ret.push_back(c);
+            }
+        }
+        ret.push_back('"');
+
+        return ret;
+    }
+
+    std::string jsonOfPointer(void* p)
+    {
+        char buf[32] = {0};
+        sprintf(buf, "\"%p\"", p);
+        return buf;
+    }
+
+    std::string jsonOfSite(const DeadlockChecker::SourceSite* site)
+    {
+        if (!site)
+            return "null";
+
+        std::string ret = "{\"file\":";
+        ret.append(jsonOfString(site->filename));
+        ret.append(",\"line\":").append(std::to_string(site->line));
+        ret.append(",\"function\":").append(jsonOfString(site->function)).append("}");
+        return ret;
+    }
+}
+
+void DeadlockChecker::init()
+{
+    if (!s_this)
+        s_this = new DeadlockChecker();
+}
+
+DeadlockChecker *DeadlockChecker::share()
+{
+    return s_this;
+}
+
+void DeadlockChecker::release()
+{
+    delete s_this;
+    s_this = NULL;
+}
+
+void DeadlockChecker::setEnabled(bool enabled)
+{
+    if (enabled && !s_enabled && s_this)
+        s_this->resetTracking();
+
+    s_enabled = enabled;
+}
+
+void DeadlockChecker::resetTracking()
+{
+    std::lock_guard<std::recursive_mutex> lockGuard(m_mutex);
+    StripeGuard stripeGuard(*this, ~(uint64_t)0);
+
+    // whatever was released while disabled is unknown, start from an empty state
+    for (unsigned i = 0; i < m_lockPathCount; ++i)
+    {
+        LockPath* path = findLockPath(i);
+        if (!path)
+            continue;
+
+        std::lock_guard<std::mutex> pathGuard(path->mutex);
+        path->count.clear();
+        path->heldStripes = 0;
+        std::fill(path->stripeHeld, path->stripeHeld + LOCK_STRIPE_COUNT, 0);
+        path->isEnabledLate = path->isLive;
+    }
+    for (auto& stripe : m_stripes)
+    {
+        stripe.locks.clear();
+        stripe.idleLockCount = 0;
+    }
+}
+
+bool DeadlockChecker::isUntracked(void *p)
+{
+    StripeGuard stripeGuard(*this, stripeBit(p));
+    return !m_stripes[stripeOf(p)].locks.count(p);
+}
+
+void DeadlockChecker::lock()
+{
+    m_mutex.lock();
+}
+
+void DeadlockChecker::unlock()
+{
+    m_mutex.unlock();
+}
+
+void DeadlockChecker::setLockOrderCheck(bool enabled)
+{
+    m_lockOrderCheck = enabled;
+}
+
+bool DeadlockChecker::isLockOrderCheckEnabled()
+{
+    return m_lockOrderCheck;
+}
+
+void DeadlockChecker::removeLock(void *p)
+{
+    LockStripe& stripe = m_stripes[stripeOf(p)];
+
+    // most locks have neither, their teardown stays off the global mutexes
+    if (stripe.orderNodeCount.load(std::memory_order_acquire))
+        dropOrderNode(p);
+
+    if (stripe.taggedCount.load(std::memory_order_acquire))
+    {
+        std::lock_guard<std::mutex> classGuard(m_classMutex);
+        if (m_lockTags.erase(p))
+            stripe.taggedCount.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    StripeGuard stripeGuard(*this, stripeBit(p));
+    stripe.firstSites.erase(p);
+    auto it = stripe.locks.find(p);
+    if (it != stripe.locks.end() && it->second.isIdle)
+    {
+        stripe.locks.erase(it);
+        --stripe.idleLockCount;
+    }
+}
+
+void DeadlockChecker::reserve(size_t lockCount, size_t heldCount)
+{
+    // stripes fill unevenly, leave each some room above its share
+    size_t stripeCount = lockCount / LOCK_STRIPE_COUNT;
+    stripeCount += stripeCount / 2 + 8;
+    for (auto& stripe : m_stripes)
+    {
+        std::lock_guard<std::mutex> stripeGuard(stripe.mutex);
+        stripe.locks.reserve(stripeCount);
+    }
+
+    LockPath& path = getCurrentLockPath();
+    std::lock_guard<std::mutex> pathGuard(path.mutex);
+    path.count.reserve(heldCount);
+}
+
+size_t DeadlockChecker::allocationCount()
+{
+    return CheckerAllocations::count();
+}
+
+void DeadlockChecker::setHistoryDepth(size_t depth)
+{
+    m_historyDepth = depth ? depth : 1;
+}
+
+size_t DeadlockChecker::historyDepth()
+{
+    return m_historyDepth;
+}
+
+void DeadlockChecker::setAsyncMode(bool async)
+{
+    if (async == m_asyncMode)
+        return;
+
+    if (async)
+    {
+        m_analyzerStop = false;
+        m_asyncMode = true;
+        m_analyzer = std::thread(&DeadlockChecker::runAnalyzer, this);
+    }
+    else
+    {
+        m_asyncMode = false;
+        {
+            std::lock_guard<std::mutex> analyzerGuard(m_analyzerMutex);
+            m_analyzerStop = true;
+        }
+        m_analyzerCondition.notify_one();
+        m_analyzer.join();
+    }
+}
+
+bool DeadlockChecker::isAsyncMode()
+{
+    return m_asyncMode;
+}
+
+void DeadlockChecker::setReportCallback(const DeadlockChecker::ReportCallback &callback)
+{
+    std::lock_guard<std::mutex> analyzerGuard(m_analyzerMutex);
+    m_reportCallback = callback;
+}
+
+size_t DeadlockChecker::asyncStalls()
+{
+    return m_asyncStalls;
+}
+
+void DeadlockChecker::pushEvent(void *p, const DeadlockChecker::SourceSite *site, int flagLock, bool isRecursive, bool isLockAction)
+{
+    EventQueue& queue = getCurrentLockPath().events;
+    if (queue.events.empty())
+        queue.events.resize(EVENT_QUEUE_SIZE);
+
+    size_t tail = queue.tail.load(std::memory_order_relaxed);
+    if (tail - queue.head.load(std::memory_order_acquire) == queue.events.size())
+    {
+        // dropping an event would desynchronise the replayed state, so wait for the analyzer
+        ++m_asyncStalls;
+        m_analyzerCondition.notify_one();
+        while (tail - queue.head.load(std::memory_order_acquire) == queue.events.size())
+            std::this_thread::yield();
+    }
+
+    LockEvent& event = queue.events[tail & (queue.events.size() - 1)];
+    event.p = p;
+    event.site = site;
+    event.timestamp = nowNanoseconds();
+    event.flagLock = flagLock;
+    event.isRecursive = isRecursive;
+    event.isLockAction = isLockAction;
+    queue.tail.store(tail + 1, std::memory_order_release);
+}
+
+void DeadlockChecker::runAnalyzer()
+{
+    for (;;)
+    {
+        bool busy = drainEvents();
+
+        std::unique_lock<std::mutex> analyzerGuard(m_analyzerMutex);
+        if (m_analyzerStop)
+        {
+            analyzerGuard.unlock();
+            while (drainEvents()) {}
+            return;
+        }
+
+        if (!busy)
+            m_analyzerCondition.wait_for(analyzerGuard, std::chrono::milliseconds(ANALYZER_INTERVAL_MS));
+    }
+}
+
+bool DeadlockChecker::drainEvents()
+{
+    std::vector<LockPath*>& paths = m_analyzerPaths;
+    paths.clear();
+    {
+        std::lock_guard<std::recursive_mutex> lockGuard(m_mutex);
+        for (unsigned i = 0; i < m_lockPathCount; ++i)
+        {
+            LockPath* path = findLockPath(i);
+            if (path)
+                paths.push_back(path);
+        }
+    }
+
+    // threads stamp an event before publishing it, so a thread may still publish one
+    // older than what another queue shows. Events newer than the oldest last visible
+    // event of the queues with pending events stay queued for the next batch
+    std::vector<size_t>& tails = m_analyzerTails;
+    tails.resize(paths.size());
+    int64_t cutoff = INT64_MAX;
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        EventQueue& queue = paths[i]->events;
+        tails[i] = queue.tail.load(std::memory_order_acquire);
+        if (tails[i] != queue.head.load(std::memory_order_relaxed))
+            cutoff = std::min(cutoff, queue.events[(tails[i] - 1) & (queue.events.size() - 1)].timestamp);
+    }
+
+    std::vector<std::pair<LockEvent, LockPath*>>& batch = m_analyzerBatch;
+    batch.clear();
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        EventQueue& queue = paths[i]->events;
+        size_t head = queue.head.load(std::memory_order_relaxed);
+        for (; head != tails[i]; ++head)
+        {
+            const LockEvent& event = queue.events[head & (queue.events.size() - 1)];
+            if (event.timestamp > cutoff)
+                break;
+            batch.push_back(std::make_pair(event, paths[i]));
+        }
+        queue.head.store(head, std::memory_order_release);
+    }
+
+    if (batch.empty())
+        return false;
+
+    if (paths.size() > 1)
+        std::stable_sort(batch.begin(), batch.end(),
+        [](const std::pair<LockEvent, LockPath*>& a, const std::pair<LockEvent, LockPath*>& b)
+        {
+            return a.first.timestamp < b.first.timestamp;
+        });
+
+    std::vector<DeadlockReport> reports;
+    for (auto& it : batch)
+    {
+        const LockEvent& event = it.first;
+        DeadlockReport report;
+        it.second->replayTime = event.timestamp;
+        if (event.isLockAction && (event.site->kind & SITE_TRY))
+        {
+            if (!doRecordTryLock(event.p, event.site, report, event.flagLock, event.isRecursive, *it.second))
+                reports.push_back(std::move(report));
+        }
+        else if (event.isLockAction)
+        {
+            if (!doCheckLock(event.p, event.site, report, event.flagLock, event.isRecursive, *it.second))
+            {
+                // the application took the lock anyway, keep following it
+                forceRecord(event.p, event.site, event.flagLock, event.isRecursive, *it.second);
+                if (report.kind == DeadlockReport::REPORT_DEADLOCK)
+                    collectLocks(report);
+                reports.push_back(std::move(report));
+            }
+        }
+        else if (!doCheckUnlock(event.p, event.site, report, event.flagLock, *it.second))
+        {
+            reports.push_back(std::move(report));
+        }
+        it.second->replayTime = 0;
+    }
+
+    // an exiting thread waits for this before its path is read and cleared
+    for (LockPath* path : paths)
+        path->events.replayed.store(path->events.head.load(std::memory_order_relaxed), std::memory_order_release);
+
+    for (auto& report : reports)
+        deliverReport(report);
+
+    return true;
+}
+
+void DeadlockChecker::forceRecord(void *p, const DeadlockChecker::SourceSite *site, int flagLock, bool isRecursive,
+    DeadlockChecker::LockPath &path)
+{
+    StripeGuard stripeGuard(*this, stripeBit(p));
+
+    Lock& lock = getLock(p, isRecursive, flagLock != FLAG_DEFAULT, site);
+    countOfHolder(lock.holders.get(path.threadIndex), flagLock)++;
+    record(lock, site, path, flagLock);
+}
+
+void DeadlockChecker::setSampling(unsigned sampleRate, unsigned cleanOrderLimit)
+{
+    m_sampleRate = sampleRate;
+    m_cleanOrderLimit = cleanOrderLimit;
+}
+
+size_t DeadlockChecker::checkedCount()
+{
+    std::lock_guard<std::recursive_mutex> lockGuard(m_mutex);
+
+    size_t count = 0;
+    for (unsigned i = 0; i < m_lockPathCount; ++i)
+    {
+        LockPath* path = findLockPath(i);
+        if (path)
+            count += path->checkedCount;
+    }
+    return count;
+}
+
+size_t DeadlockChecker::skippedCount()
+{
+    std::lock_guard<std::recursive_mutex> lockGuard(m_mutex);
+
+    size_t count = 0;
+    for (unsigned i = 0; i < m_lockPathCount; ++i)
+    {
+        LockPath* path = findLockPath(i);
+        if (path)
+            count += path->skippedCount;
+    }
+    return count;
+}
+
+std::vector<DeadlockChecker::StripeStats> DeadlockChecker::stripeStats()
+{
+    std::vector<StripeStats> stats;
+    stats.reserve(LOCK_STRIPE_COUNT);
+    for (auto& stripe : m_stripes)
+        stats.push_back(StripeStats{stripe.acquisitions.load(std::memory_order_relaxed),
+                                    stripe.contentions.load(std::memory_order_relaxed)});
+
+    return stats;
+}
+
+void DeadlockChecker::setLockClassMode(DeadlockChecker::LockClassMode mode)
+{
+    std::lock_guard<std::mutex> orderGuard(m_orderMutex);
+    std::lock_guard<std::mutex> classGuard(m_classMutex);
+
+    // edges between classes of different modes are meaningless together
+    if (m_lockClassMode != mode)
+    {
+        m_orderGraph.clear();
+        m_reportedInversions.clear();
+        for (auto& stripe : m_stripes)
+            stripe.orderNodeCount.store(0, std::memory_order_relaxed);
+        ++m_orderGeneration;
+    }
+    m_lockClassMode = mode;
+}
+
+DeadlockChecker::LockClassMode DeadlockChecker::lockClassMode()
+{
+    std::lock_guard<std::mutex> classGuard(m_classMutex);
+    return m_lockClassMode;
+}
+
+void DeadlockChecker::setLockClass(void *p, const char *tag)
+{
+    std::lock_guard<std::mutex> classGuard(m_classMutex);
+    const std::string*& name = m_lockTags[p];
+    if (!name)
+        m_stripes[stripeOf(p)].taggedCount.fetch_add(1, std::memory_order_release);
+    name = &*m_lockTagNames.insert(tag).first;
+}
+
+bool DeadlockChecker::checkLock(void *p, const SourceSite* site, DeadlockReport &report)
+{
+    return doCheckLock(p, site, report, FLAG_DEFAULT, false);
+}
+
+bool DeadlockChecker::checkRecursiveLock(void *p, const SourceSite* site, DeadlockReport &report)
+{
+    return doCheckLock(p, site, report, FLAG_DEFAULT, true);
+}
+
+bool DeadlockChecker::checkUnlock(void *p, const SourceSite* site, DeadlockReport &report)
+{
+    return doCheckUnlock(p, site, report, FLAG_DEFAULT);
+}
+
+bool DeadlockChecker::checkReadLock(void *p, const SourceSite* site, DeadlockReport &report)
+{
+    return doCheckLock(p, site, report, FLAG_READ, false);
+}
+
+bool DeadlockChecker::checkRecursiveReadLock(void *p, const SourceSite* site, DeadlockReport &report)
+{
+    return doCheckLock(p, site, report, FLAG_READ, true);
+}
+
+bool DeadlockChecker::checkReadUnlock(void *p, const SourceSite* site, DeadlockReport &report)
+{
+    return doCheckUnlock(p, site, report, FLAG_READ);
+}
+
+bool DeadlockChecker::checkWriteLock(void *p, const SourceSite* site, DeadlockReport &report)
+{
+    return doCheckLock(p, site, report, FLAG_WRITE, false);
+}
+
+bool DeadlockChecker::checkRecursiveWriteLock(void *p, const SourceSite* site, DeadlockReport &report)
+{
+    return doCheckLock(p, site, report, FLAG_WRITE, true);
+}
+
+bool DeadlockChecker::checkWriteUnlock(void *p, const SourceSite* site, DeadlockReport &report)
+{
+    return doCheckUnlock(p, site, report, FLAG_WRITE);
+}
+
+bool DeadlockChecker::checkTryLock(void *p, const SourceSite* site, DeadlockReport &report)
+{
+    int flagLock = flagOfSite(site);
+    bool isRecursive = (site->kind & SITE_RECURSIVE) != 0;
+    if (m_asyncMode.load(std::memory_order_relaxed))
+    {
+        pushEvent(p, site, flagLock, isRecursive, true);
+        return true;
+    }
+
+    return doRecordTryLock(p, site, report, flagLock, isRecursive, getCurrentLockPath());
+}
+
+void DeadlockChecker::lockChecked(void *p, const DeadlockChecker::SourceSite *site)
+{
+    int flagLock = flagOfSite(site);
+    bool isRecursive = (site->kind & SITE_RECURSIVE) != 0;
+    DeadlockReport report;
+    if (doCheckLock(p, site, report, flagLock, isRecursive))
+        return;
+
+    // the wrapper takes the lock anyway, keep following it
+    forceRecord(p, site, flagLock, isRecursive, getCurrentLockPath());
+    deliverReport(report);
+}
+
+void DeadlockChecker::tryLockChecked(void *p, const DeadlockChecker::SourceSite *site, bool acquired)
+{
+    DeadlockReport report;
+    if (acquired && !checkTryLock(p, site, report))
+        deliverReport(report);
+
+    if (s_profiling.load(std::memory_order_relaxed))
+        profileTry(p, site, acquired);
+}
+
+void DeadlockChecker::unlockChecked(void *p, const DeadlockChecker::SourceSite *site)
+{
+    DeadlockReport report;
+    if (!doCheckUnlock(p, site, report, flagOfSite(site)))
+        deliverReport(report);
+}
+
+void DeadlockChecker::reportLevelInversion(void *p, unsigned level, void *held, unsigned heldLevel)
+{
+    DeadlockReport report;
+    report.kind = DeadlockReport::REPORT_LEVEL_INVERSION;
+    report.p = p;
+    report.held = held;
+    report.level = level;
+    report.heldLevel = heldLevel;
+    report.threads.resize(1);
+    report.threads[0].threadID = ThreadIdentity::currentID();
+
+    DeadlockChecker* checker = s_this;
+    if (checker)
+        checker->deliverReport(report);
+    else
+        fprintf(stderr, "%s\n", report.toString().c_str());
+}
+
+bool DeadlockChecker::checkUpgradeableLock(void *p, const SourceSite* site, DeadlockReport &report)
+{
+    return doCheckLock(p, site, report, FLAG_READ, true);
+}
+
+bool DeadlockChecker::checkUpgrade(void *p, const SourceSite* site, DeadlockReport &report)
+{
+    if (!doCheckUnlock(p, site, report, FLAG_READ))
+        return false;
+
+    // other readers still have to drain, and the thread's own extra reads never will
+    if (!doCheckLock(p, site, report, FLAG_WRITE, true))
+    {
+        forceRecord(p, site, FLAG_READ, true, getCurrentLockPath());
+        return false;
+    }
+
+    return true;
+}
+
+bool DeadlockChecker::checkDowngrade(void *p, const SourceSite* site, DeadlockReport &report)
+{
+    if (!doCheckUnlock(p, site, report, FLAG_WRITE))
+        return false;
+
+    if (!doCheckLock(p, site, report, FLAG_READ, true))
+    {
+        forceRecord(p, site, FLAG_WRITE, true, getCurrentLockPath());
+        return false;
+    }
+
+    return true;
+}
+
+bool DeadlockChecker::checkLock(void *p, const SourceSite* site, std::string &err)
+{
+    DeadlockReport report;
+    return formatReport(checkLock(p, site, report), report, err);
+}
+
+bool DeadlockChecker::checkRecursiveLock(void *p, const SourceSite* site, std::string &err)
+{
+    DeadlockReport report;
+    return formatReport(checkRecursiveLock(p, site, report), report, err);
+}
+
+bool DeadlockChecker::checkUnlock(void *p, const SourceSite* site, std::string &err)
+{
+    DeadlockReport report;
+    return formatReport(checkUnlock(p, site, report), report, err);
+}
+
+bool DeadlockChecker::checkReadLock(void *p, const SourceSite* site, std::string &err)
+{
+    DeadlockReport report;
+    return formatReport(checkReadLock(p, site, report), report, err);
+}
+
+bool DeadlockChecker::checkRecursiveReadLock(void *p, const SourceSite* site, std::string &err)
+{
+    DeadlockReport report;
+    return formatReport(checkRecursiveReadLock(p, site, report), report, err);
+}
+
+bool DeadlockChecker::checkReadUnlock(void *p, const SourceSite* site, std::string &err)
+{
+    DeadlockReport report;
+    return formatReport(checkReadUnlock(p, site, report), report, err);
+}
+
+bool DeadlockChecker::checkWriteLock(void *p, const SourceSite* site, std::string &err)
+{
+    DeadlockReport report;
+    return formatReport(checkWriteLock(p, site, report), report, err);
+}
+
+bool DeadlockChecker::checkRecursiveWriteLock(void *p, const SourceSite* site, std::string &err)
+{
+    DeadlockReport report;
+    return formatReport(checkRecursiveWriteLock(p, site, report), report, err);
+}
+
+bool DeadlockChecker::checkWriteUnlock(void *p, const SourceSite* site, std::string &err)
+{
+    DeadlockReport report;
+    return formatReport(checkWriteUnlock(p, site, report), report, err);
+}
+
+bool DeadlockChecker::checkTryLock(void *p, const SourceSite* site, std::string &err)
+{
+    DeadlockReport report;
+    return formatReport(checkTryLock(p, site, report), report, err);
+}
+
+bool DeadlockChecker::checkUpgradeableLock(void *p, const SourceSite* site, std::string &err)
+{
+    DeadlockReport report;
+    return formatReport(checkUpgradeableLock(p, site, report), report, err);
+}
+
+bool DeadlockChecker::checkUpgrade(void *p, const SourceSite* site, std::string &err)
+{
+    DeadlockReport report;
+    return formatReport(checkUpgrade(p, site, report), report, err);
+}
+
+bool DeadlockChecker::checkDowngrade(void *p, const SourceSite* site, std::string &err)
+{
+    DeadlockReport report;
+    return formatReport(checkDowngrade(p, site, report), report, err);
+}
+
+bool DeadlockChecker::checkLock(void *p, const char *filename, int line, std::string &err, const std::type_info* type)
+{
+    return checkLock(p, internSite(filename, line, SITE_LOCK, type), err);
+}
+
+bool DeadlockChecker::checkRecursiveLock(void *p, const char *filename, int line, std::string &err, const std::type_info* type)
+{
+    return checkRecursiveLock(p, internSite(filename, line, SITE_RECURSIVE, type), err);
+}
+
+bool DeadlockChecker::checkTryLock(void *p, const char *filename, int line, std::string &err, const std::type_info* type)
+{
+    return checkTryLock(p, internSite(filename, line, SITE_TRY, type), err);
+}
+
+bool DeadlockChecker::checkRecursiveTryLock(void *p, const char *filename, int line, std::string &err, const std::type_info* type)
+{
+    return checkTryLock(p, internSite(filename, line, SITE_TRY | SITE_RECURSIVE, type), err);
+}
+
+bool DeadlockChecker::checkUnlock(void *p, const char *filename, int line, std::string &err)
+{
+    return checkUnlock(p, internSite(filename, line, SITE_UNLOCK, NULL), err);
+}
+
+bool DeadlockChecker::checkReadLock(void *p, const char *filename, int line, std::string &err, const std::type_info* type)
+{
+    return checkReadLock(p, internSite(filename, line, SITE_READ, type), err);
+}
+
+bool DeadlockChecker::checkRecursiveReadLock(void *p, const char *filename, int line, std::string &err, const std::type_info* type)
+{
+    return checkRecursiveReadLock(p, internSite(filename, line, SITE_READ | SITE_RECURSIVE, type), err);
+}
+
+bool DeadlockChecker::checkReadUnlock(void *p, const char *filename, int line, std::string &err)
+{
+    return checkReadUnlock(p, internSite(filename, line, SITE_READ | SITE_UNLOCK, NULL), err);
+}
+
+bool DeadlockChecker::checkWriteLock(void *p, const char *filename, int line, std::string &err, const std::type_info* type)
+{
+    return checkWriteLock(p, internSite(filename, line, SITE_WRITE, type), err);
+}
+
+bool DeadlockChecker::checkRecursiveWriteLock(void *p, const char *filename, int line, std::string &err, const std::type_info* type)
+{
+    return checkRecursiveWriteLock(p, internSite(filename, line, SITE_WRITE | SITE_RECURSIVE, type), err);
+}
+
+bool DeadlockChecker::checkWriteUnlock(void *p, const char *filename, int line, std::string &err)
+{
+    return checkWriteUnlock(p, internSite(filename, line, SITE_WRITE | SITE_UNLOCK, NULL), err);
+}
+
+const DeadlockChecker::SourceSite *DeadlockChecker::internSite(const char *filename, int line, int kind, const std::type_info *type)
+{
+    std::lock_guard<std::mutex> siteGuard(m_siteMutex);
+
+    auto it = m_internedSites.find(std::make_tuple(std::string(filename), line, kind, type));
+    if (it == m_internedSites.end())
+    {
+        it = m_internedSites.insert(std::make_pair(std::make_tuple(std::string(filename), line, kind, type), SourceSite())).first;
+        it->second = SourceSite{std::get<0>(it->first).c_str(), line, "", kind, type};
+    }
+
+    return &it->second;
+}
+
+DeadlockChecker::Lock &DeadlockChecker::getLock(void* p, bool isRecursive, bool isReadWriteLock, const SourceSite* site)
+{
+    LockStripe& stripe = m_stripes[stripeOf(p)];
+    auto it = stripe.locks.find(p);
+    if (it == stripe.locks.end())
+    {
+        // idle entries are only dropped once they are the majority, otherwise grow
+        if (stripe.locks.full() && stripe.idleLockCount * 2 >= stripe.locks.size())
+            sweepIdleLocks(stripe);
+        it = stripe.locks.insert(std::make_pair(p, Lock())).first;
+    }
+    else if (!it->second.isIdle)
+    {
+        return it->second;
+    }
+
+    Lock& lock = it->second;
+    if (lock.isIdle)
+        --stripe.idleLockCount;
+    lock.p = p;
+    lock.isRecursive = isRecursive;
+    lock.isReadWriteLock = isReadWriteLock;
+    lock.isIdle = false;
+    lock.firstSite = site;
+    lock.lockClass = classOfLock(p, site);
+
+    return lock;
+}
+
+void DeadlockChecker::sweepIdleLocks(LockStripe& stripe)
+{
+    std::vector<void*> idleLocks;
+    for (auto& it : stripe.locks)
+    {
+        if (it.second.isIdle)
+            idleLocks.push_back(it.first);
+    }
+
+    for (void* p : idleLocks)
+        stripe.locks.erase(p);
+    stripe.idleLockCount = 0;
+}
+
+DeadlockChecker::Lock &DeadlockChecker::getLock(void *p)
+{
+    LockStripe& stripe = m_stripes[stripeOf(p)];
+    auto it = stripe.locks.find(p);
+    assert(it != stripe.locks.end());
+
+    return it->second;
+}
+
+unsigned DeadlockChecker::stripeOf(void *p)
+{
+    // the top bits, the tables inside a stripe index by the low ones
+    return (unsigned)(flatHashOf(p) >> (sizeof(size_t) * 8 - LOCK_STRIPE_BITS));
+}
+
+uint64_t DeadlockChecker::stripeBit(void *p)
+{
+    return (uint64_t)1 << stripeOf(p);
+}
+
+bool DeadlockChecker::hasOtherHolder(const DeadlockChecker::Lock &lock, unsigned threadIndex)
+{
+    return lock.holders.size() > 1 || (lock.holders.size() == 1 && lock.holders.begin()->thread != threadIndex);
+}
+
+void DeadlockChecker::lockStripes(uint64_t mask)
+{
+    for (; mask; mask &= mask - 1)
+    {
+        LockStripe& stripe = m_stripes[lowestBit(mask)];
+        bool contended = !stripe.mutex.try_lock();
+        if (contended)
+            stripe.mutex.lock();
+
+        stripe.acquisitions.store(stripe.acquisitions.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (contended)
+            stripe.contentions.store(stripe.contentions.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
+
+void DeadlockChecker::unlockStripes(uint64_t mask)
+{
+    for (; mask; mask &= mask - 1)
+        m_stripes[lowestBit(mask)].mutex.unlock();
+}
+
+DeadlockChecker::LockPath *DeadlockChecker::findLockPath(unsigned threadIndex)
+{
+    LockPathChunk& chunk = m_lockPath[threadIndex / LOCK_PATH_CHUNK_SIZE];
+    return chunk ? chunk[threadIndex % LOCK_PATH_CHUNK_SIZE].get() : NULL;
+}
+
+DeadlockChecker::LockPath &DeadlockChecker::getLockPath(unsigned threadIndex)
+{
+    // only called for threads that hold a lock, so the path exists
+    return *findLockPath(threadIndex);
+}
+
+DeadlockChecker::LockPath &DeadlockChecker::getCurrentLockPath()
+{
+    CurrentLockPath& current = t_currentLockPath;
+    if (current.generation != m_generation)
+    {
+        std::unique_lock<std::recursive_mutex> lockGuard(m_mutex);
+
+        unsigned threadIndex = ThreadIdentity::currentIndex();
+        assert(threadIndex < LOCK_PATH_CHUNKS * LOCK_PATH_CHUNK_SIZE);
+
+        LockPathChunk& chunk = m_lockPath[threadIndex / LOCK_PATH_CHUNK_SIZE];
+        if (!chunk)
+        {
+            CheckerAllocations::add();
+            chunk.reset(new std::unique_ptr<LockPath>[LOCK_PATH_CHUNK_SIZE]);
+        }
+
+        std::unique_ptr<LockPath>& path = chunk[threadIndex % LOCK_PATH_CHUNK_SIZE];
+        if (!path)
+        {
+            CheckerAllocations::add();
+            path.reset(new LockPath());
+            path->threadIndex = threadIndex;
+            path->path.resize(m_historyDepth);
+        }
+        if (threadIndex >= m_lockPathCount)
+            m_lockPathCount = threadIndex + 1;
+
+        LockPath* currentPath = path.get();
+        lockGuard.unlock();
+
+        // the previous owner of the index exited without its exit hook running
+        if (currentPath->isLive)
+            releaseLockPath(*currentPath);
+
+        // declared after the identity, so it is destroyed first and the index
+        // is not handed on before the path is released
+        static thread_local ThreadExit threadExit;
+        (void)threadExit;
+
+        {
+            std::lock_guard<std::mutex> pathGuard(currentPath->mutex);
+            currentPath->threadID = ThreadIdentity::currentID();
+            currentPath->isLive = true;
+        }
+
+        current.path = currentPath;
+        current.generation = m_generation;
+    }
+
+    return *static_cast<LockPath*>(current.path);
+}
+
+void DeadlockChecker::releaseLockPath(DeadlockChecker::LockPath &path)
+{
+    // whatever the thread queued has to be replayed before its state goes
+    if (m_asyncMode.load(std::memory_order_relaxed))
+    {
+        EventQueue& queue = path.events;
+        while (queue.replayed.load(std::memory_order_acquire) != queue.tail.load(std::memory_order_relaxed))
+        {
+            m_analyzerCondition.notify_one();
+            std::this_thread::yield();
+        }
+    }
+
+    DeadlockReport report;
+    std::vector<void*> held;
+    {
+        std::lock_guard<std::mutex> pathGuard(path.mutex);
+        if (!path.count.empty())
+        {
+            report.kind = DeadlockReport::REPORT_THREAD_EXIT;
+            report.threads.resize(1);
+            snapshotOf(path, report.threads[0]);
+            for (auto& it : path.count)
+                held.push_back(it.first);
+        }
+    }
+
+    // the locks stay taken, but the index goes to another thread and must not hold them
+    for (void* p : held)
+    {
+        StripeGuard stripeGuard(*this, stripeBit(p));
+        LockStripe& stripe = m_stripes[stripeOf(p)];
+        auto it = stripe.locks.find(p);
+        if (it == stripe.locks.end())
+            continue;
+
+        Lock& lock = it->second;
+        HolderSet::Holder* holder = lock.holders.find(path.threadIndex);
+        if (!holder)
+            continue;
+
+        lock.holders.erase(holder);
+        if (lock.holders.empty() && !lock.isIdle)
+        {
+            lock.isIdle = true;
+            ++stripe.idleLockCount;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> pathGuard(path.mutex);
+        path.count.clear();
+        path.heldStripes = 0;
+        std::fill(path.stripeHeld, path.stripeHeld + LOCK_STRIPE_COUNT, 0);
+        path.path.clear();
+        path.samples.clear();
+        path.isLive = false;
+        path.isEnabledLate = false;
+    }
+
+    if (!path.siteProfiles.empty() || !path.lockProfiles.empty() || !path.holdProfiles.empty())
+        retireProfiles(path);
+
+    if (report.kind != DeadlockReport::REPORT_NONE)
+        deliverReport(report);
+}
+
+void DeadlockChecker::deliverReport(const DeadlockChecker::DeadlockReport &report)
+{
+    ReportCallback callback;
+    {
+        std::lock_guard<std::mutex> analyzerGuard(m_analyzerMutex);
+        callback = m_reportCallback;
+    }
+    if (callback)
+        callback(report);
+    else
+        fprintf(stderr, "%s\n", report.toString().c_str());
+}
+
+void DeadlockChecker::beginWait(DeadlockChecker::WaitScope &wait)
+{
+    LockPath& path = getCurrentLockPath();
+    int64_t now = nowNanoseconds();
+    wait.m_path = &path;
+    if (s_profiling.load(std::memory_order_relaxed))
+        wait.m_start = now;
+
+    if (s_watching.load(std::memory_order_relaxed))
+    {
+        path.waitingSince.store(now, std::memory_order_relaxed);
+        path.waitingFlag.store(flagOfSite(wait.m_site), std::memory_order_relaxed);
+        path.waitingOn.store(wait.m_p, std::memory_order_release);
+    }
+}
+
+void DeadlockChecker::endWait(DeadlockChecker::WaitScope &wait)
+{
+    LockPath& path = *wait.m_path;
+    path.waitingOn.store(NULL, std::memory_order_release);
+    if (!wait.m_start)
+        return;
+
+    int64_t nanoseconds = nowNanoseconds() - wait.m_start;
+    bool contended = nanoseconds >= m_profileContended.load(std::memory_order_relaxed);
+    profileOf(path, path.siteProfiles, wait.m_site).add(nanoseconds, contended);
+    profileOf(path, path.lockProfiles, wait.m_p).add(nanoseconds, contended);
+}
+
+void DeadlockChecker::WaitProfile::add(uint64_t nanoseconds, bool contended)
+{
+    // single writer, a plain load and store is enough
+    acquisitions.store(acquisitions.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    waitNanoseconds.store(waitNanoseconds.load(std::memory_order_relaxed) + nanoseconds, std::memory_order_relaxed);
+    if (nanoseconds > maxNanoseconds.load(std::memory_order_relaxed))
+        maxNanoseconds.store(nanoseconds, std::memory_order_relaxed);
+    if (contended)
+        contentions.store(contentions.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    unsigned bucket = nanoseconds ? highestBit(nanoseconds) : 0;
+    if (bucket >= ContentionProfile::BUCKETS)
+        bucket = ContentionProfile::BUCKETS - 1;
+    histogram[bucket].store(histogram[bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void DeadlockChecker::WaitProfile::mergeInto(DeadlockChecker::ContentionProfile::Entry &entry) const
+{
+    entry.acquisitions += acquisitions.load(std::memory_order_relaxed);
+    entry.contentions += contentions.load(std::memory_order_relaxed);
+    entry.tryFailures += tryFailures.load(std::memory_order_relaxed);
+    entry.waitNanoseconds += waitNanoseconds.load(std::memory_order_relaxed);
+    entry.maxNanoseconds = std::max(entry.maxNanoseconds, (uint64_t)maxNanoseconds.load(std::memory_order_relaxed));
+    for (int i = 0; i < ContentionProfile::BUCKETS; ++i)
+        entry.histogram[i] += histogram[i].load(std::memory_order_relaxed);
+}
+
+template<class K>
+DeadlockChecker::WaitProfile &DeadlockChecker::profileOf(DeadlockChecker::LockPath &path,
+    CheckerMap<K, std::unique_ptr<WaitProfile>> &profiles, K key)
+{
+    auto it = profiles.find(key);
+    if (it != profiles.end())
+        return *it->second;
+
+    // merging may be iterating the table
+    CheckerAllocations::add();
+    std::unique_ptr<WaitProfile> profile(new WaitProfile);
+    WaitProfile& ret = *profile;
+    std::lock_guard<std::mutex> pathGuard(path.mutex);
+    profiles.insert(std::make_pair(key, std::move(profile)));
+    return ret;
+}
+
+void DeadlockChecker::setProfiling(bool enabled, unsigned contendedNanoseconds)
+{
+    m_profileContended = contendedNanoseconds;
+    s_profiling = enabled;
+}
+
+void DeadlockChecker::profileTry(void *p, const DeadlockChecker::SourceSite *site, bool acquired)
+{
+    LockPath& path = getCurrentLockPath();
+    WaitProfile* profiles[] = {&profileOf(path, path.siteProfiles, site), &profileOf(path, path.lockProfiles, p)};
+    for (WaitProfile* profile : profiles)
+    {
+        if (acquired)
+            profile->add(0, false);
+        else
+            profile->tryFailures.store(profile->tryFailures.load(std::memory_order_relaxed) + 1,
+                                       std::memory_order_relaxed);
+    }
+}
+
+DeadlockChecker::ContentionProfile DeadlockChecker::contentionProfile()
+{
+    std::vector<LockPath*> paths;
+    {
+        std::lock_guard<std::recursive_mutex> lockGuard(m_mutex);
+        for (unsigned i = 0; i < m_lockPathCount; ++i)
+        {
+            LockPath* path = findLockPath(i);
+            if (path)
+                paths.push_back(path);
+        }
+    }
+
+    std::unordered_map<const SourceSite*, ContentionProfile::Entry> sites;
+    std::unordered_map<void*, ContentionProfile::Entry> locks;
+    {
+        // held throughout, so a thread exiting meanwhile is counted once
+        std::lock_guard<std::mutex> profileGuard(m_profileMutex);
+        sites = m_retiredSites;
+        locks = m_retiredLocks;
+        for (LockPath* path : paths)
+        {
+            std::lock_guard<std::mutex> pathGuard(path->mutex);
+            for (auto& it : path->siteProfiles)
+                it.second->mergeInto(sites[it.first]);
+            for (auto& it : path->lockProfiles)
+                it.second->mergeInto(locks[it.first]);
+        }
+    }
+
+    ContentionProfile ret;
+    for (auto& it : sites)
+    {
+        it.second.site = it.first;
+        ret.sites.push_back(it.second);
+    }
+    for (auto& it : locks)
+    {
+        it.second.p = it.first;
+        ret.locks.push_back(it.second);
+    }
+
+    std::sort(ret.sites.begin(), ret.sites.end(), longerTime);
+    std::sort(ret.locks.begin(), ret.locks.end(), longerTime);
+    return ret;
+}
+
+void DeadlockChecker::retireProfiles(DeadlockChecker::LockPath &path)
+{
+    std::lock_guard<std::mutex> profileGuard(m_profileMutex);
+    std::lock_guard<std::mutex> pathGuard(path.mutex);
+    for (auto& it : path.siteProfiles)
+        it.second->mergeInto(m_retiredSites[it.first]);
+    for (auto& it : path.lockProfiles)
+        it.second->mergeInto(m_retiredLocks[it.first]);
+    for (auto& it : path.holdProfiles)
+        it.second->mergeInto(m_retiredHolds[it.first]);
+
+    path.siteProfiles.clear();
+    path.lockProfiles.clear();
+    path.holdProfiles.clear();
+}
+
+void DeadlockChecker::setHoldTracking(bool enabled, unsigned thresholdMicroseconds)
+{
+    m_holdThreshold = thresholdMicroseconds;
+    m_holdTracking = enabled;
+}
+
+void DeadlockChecker::recordHold(DeadlockChecker::LockPath &path, void *p, const DeadlockChecker::SourceSite *site,
+    int64_t nanoseconds)
+{
+    unsigned threshold = m_holdThreshold.load(std::memory_order_relaxed);
+    bool isLong = threshold && nanoseconds >= (int64_t)threshold * 1000;
+    profileOf(path, path.holdProfiles, site).add(nanoseconds, isLong);
+    if (!isLong)
+        return;
+
+    DeadlockReport report;
+    report.kind = DeadlockReport::REPORT_LONG_HOLD;
+    report.p = p;
+    report.site = site;
+    report.heldMicroseconds = nanoseconds / 1000;
+    report.threads.resize(1);
+    {
+        std::lock_guard<std::mutex> pathGuard(path.mutex);
+        snapshotOf(path, report.threads[0]);
+    }
+    deliverReport(report);
+}
+
+DeadlockChecker::HoldProfile DeadlockChecker::holdProfile()
+{
+    std::vector<LockPath*> paths;
+    {
+        std::lock_guard<std::recursive_mutex> lockGuard(m_mutex);
+        for (unsigned i = 0; i < m_lockPathCount; ++i)
+        {
+            LockPath* path = findLockPath(i);
+            if (path)
+                paths.push_back(path);
+        }
+    }
+
+    std::unordered_map<const SourceSite*, ContentionProfile::Entry> sites;
+    {
+        std::lock_guard<std::mutex> profileGuard(m_profileMutex);
+        sites = m_retiredHolds;
+        for (LockPath* path : paths)
+        {
+            std::lock_guard<std::mutex> pathGuard(path->mutex);
+            for (auto& it : path->holdProfiles)
+                it.second->mergeInto(sites[it.first]);
+        }
+    }
+
+    HoldProfile ret;
+    for (auto& it : sites)
+    {
+        it.second.site = it.first;
+        ret.sites.push_back(it.second);
+    }
+    std::sort(ret.sites.begin(), ret.sites.end(), longerTime);
+    return ret;
+}
+
+void DeadlockChecker::setWatchdog(bool enabled, unsigned intervalMs, unsigned stallMs)
+{
+    std::unique_lock<std::mutex> watchdogGuard(m_watchdogMutex);
+    m_watchdogInterval = intervalMs ? intervalMs : 1;
+    m_watchdogStall = stallMs;
+    if (enabled == m_watchdog.joinable())
+        return;
+
+    if (enabled)
+    {
+        m_watchdogStop = false;
+        s_watching = true;
+        m_watchdog = std::thread(&DeadlockChecker::runWatchdog, this);
+    }
+    else
+    {
+        s_watching = false;
+        m_watchdogStop = true;
+        watchdogGuard.unlock();
+        m_watchdogCondition.notify_one();
+        m_watchdog.join();
+    }
+}
+
+bool DeadlockChecker::isWatchdogEnabled()
+{
+    std::lock_guard<std::mutex> watchdogGuard(m_watchdogMutex);
+    return m_watchdog.joinable();
+}
+
+void DeadlockChecker::runWatchdog()
+{
+    WaitKeys suspects, cycles, stalls;
+
+    std::unique_lock<std::mutex> watchdogGuard(m_watchdogMutex);
+    for (;;)
+    {
+        m_watchdogCondition.wait_for(watchdogGuard, std::chrono::milliseconds(m_watchdogInterval));
+        if (m_watchdogStop)
+            return;
+
+        unsigned stallMs = m_watchdogStall;
+        watchdogGuard.unlock();
+        scanWaits(stallMs, suspects, cycles, stalls);
+        watchdogGuard.lock();
+    }
+}
+
+void DeadlockChecker::scanWaits(unsigned stallMs, WaitKeys &suspects, WaitKeys &cycles, WaitKeys &stalls)
+{
+    struct Waiter
+    {
+        LockPath* path;
+        void* p;
+        int flagLock;
+        int64_t since;
+        std::vector<unsigned> holders;
+    };
+
+    std::vector<Waiter> waiters;
+    {
+        std::lock_guard<std::recursive_mutex> lockGuard(m_mutex);
+        for (unsigned i = 0; i < m_lockPathCount; ++i)
+        {
+            LockPath* path = findLockPath(i);
+            void* p = path ? path->waitingOn.load(std::memory_order_acquire) : NULL;
+            if (p)
+                waiters.push_back(Waiter{path, p, path->waitingFlag.load(std::memory_order_relaxed),
+                                         path->waitingSince.load(std::memory_order_relaxed), {}});
+        }
+    }
+
+    WaitKeys current;
+    std::unordered_map<unsigned, size_t> waiterOf;
+    for (size_t i = 0; i < waiters.size(); ++i)
+    {
+        waiterOf[waiters[i].path->threadIndex] = i;
+        current.insert(std::make_pair(waiters[i].path->threadIndex, waiters[i].since));
+    }
+
+    // one stripe at a time, the application only waits for a single table lookup
+    for (Waiter& waiter : waiters)
+    {
+        StripeGuard stripeGuard(*this, stripeBit(waiter.p));
+        LockStripe& stripe = m_stripes[stripeOf(waiter.p)];
+        auto it = stripe.locks.find(waiter.p);
+        if (it == stripe.locks.end())
+            continue;
+
+        for (HolderSet::Holder& holder : it->second.holders)
+        {
+            if (holder.thread == waiter.path->threadIndex)
+                continue;
+
+            // readers only wait for writers
+            if (waiter.flagLock == FLAG_READ && !holder.exclusive)
+                continue;
+
+            // checked threads are recorded before they block, one queued on the same lock holds nothing yet
+            auto itWaiter = waiterOf.find(holder.thread);
+            if (itWaiter != waiterOf.end() && waiters[itWaiter->second].p == waiter.p)
+                continue;
+
+            waiter.holders.push_back(holder.thread);
+        }
+    }
+
+    int64_t now = nowNanoseconds();
+    std::vector<std::vector<size_t>> edges(waiters.size());
+    for (size_t i = 0; i < waiters.size(); ++i)
+    {
+        for (unsigned holder : waiters[i].holders)
+        {
+            auto itWaiter = waiterOf.find(holder);
+            if (itWaiter != waiterOf.end())
+                edges[i].push_back(itWaiter->second);
+        }
+    }
+
+    std::vector<int> state(waiters.size(), 0);
+    std::vector<size_t> stack;
+    std::vector<std::vector<size_t>> found;
+    for (size_t i = 0; i < waiters.size(); ++i)
+    {
+        if (!state[i])
+            findCycles(edges, i, state, stack, found);
+    }
+
+    // the waits are read one after the other, a cycle is only trusted once two scans agree
+    WaitKeys nextSuspects;
+    for (auto& cycle : found)
+    {
+        bool confirmed = true;
+        bool reported = true;
+        for (size_t i : cycle)
+        {
+            std::pair<unsigned, int64_t> key(waiters[i].path->threadIndex, waiters[i].since);
+            nextSuspects.insert(key);
+            confirmed = confirmed && suspects.count(key);
+            reported = reported && cycles.count(key);
+        }
+        if (!confirmed || reported)
+            continue;
+
+        DeadlockReport report;
+        report.kind = DeadlockReport::REPORT_WAIT_CYCLE;
+        report.p = waiters[cycle[0]].p;
+        report.threads.resize(cycle.size());
+        for (size_t j = 0; j < cycle.size(); ++j)
+        {
+            snapshotWaiting(*waiters[cycle[j]].path, report.threads[j], now);
+            cycles.insert(std::make_pair(waiters[cycle[j]].path->threadIndex, waiters[cycle[j]].since));
+        }
+        deliverReport(report);
+    }
+    suspects.swap(nextSuspects);
+
+    if (stallMs)
+    {
+        for (Waiter& waiter : waiters)
+        {
+            std::pair<unsigned, int64_t> key(waiter.path->threadIndex, waiter.since);
+            if (now - waiter.since < (int64_t)stallMs * 1000000 || stalls.count(key))
+                continue;
+
+            // the holders come after the blocked thread, whatever they are doing
+            DeadlockReport report;
+            report.kind = DeadlockReport::REPORT_STALL;
+            report.p = waiter.p;
+            report.threads.resize(1 + waiter.holders.size());
+            snapshotWaiting(*waiter.path, report.threads[0], now);
+            for (size_t j = 0; j < waiter.holders.size(); ++j)
+            {
+                LockPath* path = findLockPath(waiter.holders[j]);
+                if (path)
+                    snapshotWaiting(*path, report.threads[j + 1], now);
+            }
+            stalls.insert(key);
+            deliverReport(report);
+        }
+    }
+
+    // forget waits that ended
+    for (WaitKeys* keys : {&cycles, &stalls})
+    {
+        for (auto it = keys->begin(); it != keys->end();)
+        {
+            if (current.count(*it))
+                ++it;
+            else
+                it = keys->erase(it);
+        }
+    }
+}
+
+void DeadlockChecker::snapshotWaiting(DeadlockChecker::LockPath &path, DeadlockReport::ThreadState &state, int64_t now)
+{
+    std::lock_guard<std::mutex> pathGuard(path.mutex);
+    snapshotOf(path, state);
+
+    state.waitingOn = path.waitingOn.load(std::memory_order_acquire);
+    if (state.waitingOn)
+        state.waitMilliseconds = (now - path.waitingSince.load(std::memory_order_relaxed)) / 1000000;
+}
+
+DeadlockChecker::ThreadExit::~ThreadExit()
+{
+    CurrentLockPath& current = t_currentLockPath;
+    if (s_this && current.path && current.generation == s_this->m_generation)
+        s_this->releaseLockPath(*static_cast<LockPath*>(current.path));
+
+    current.path = NULL;
+    current.generation = 0;
+}
+
+bool DeadlockChecker::isIntersect(const LockPath& path, void* p, int flagLock, const LockPath &path2)
+{
+    if (path2.count.size() < 2 || path.count.empty())
+        return false;
+
+    if (path2.path.back().p == p)
+        return false;
+
+    auto it1 = path2.count.find(p);
+    if (it1 == path2.count.end())
+        return false;
+
+    auto it2 = path.count.find(path2.path.back().p);
+    if (it2 == path.count.end())
+        return false;
+
+    if (flagLock == FLAG_READ && !it2->second.c[INDEX_COUNT_WRITE]
+            && !it1->second.c[INDEX_COUNT_WRITE] && path2.path.back().flagLock != FLAG_WRITE)
+        return false;
+
+    return true;
+}
+
+void DeadlockChecker::reportDeadlock(DeadlockChecker::DeadlockReport &report, void *p, const SourceSite* site,
+    const DeadlockChecker::LockPath &path1, const DeadlockChecker::LockPath &path2)
+{
+    report.kind = DeadlockReport::REPORT_DEADLOCK;
+    report.p = p;
+    report.site = site;
+    report.threads.resize(2);
+    snapshotOf(path1, report.threads[0]);
+    snapshotOf(path2, report.threads[1]);
+}
+
+void DeadlockChecker::collectLocks(DeadlockChecker::DeadlockReport &report)
+{
+    // the wanted lock and what the threads in the cycle hold
+    std::vector<void*> wanted(1, report.p);
+    for (auto& thread : report.threads)
+    {
+        for (auto& held : thread.held)
+            wanted.push_back(held.p);
+    }
+
+    std::sort(wanted.begin(), wanted.end());
+    wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+    std::stable_sort(wanted.begin(), wanted.end(), [](void* a, void* b) { return stripeOf(a) < stripeOf(b); });
+
+    // the check has let go of its stripes by now, take those of the conflict one at a time
+    for (size_t i = 0; i < wanted.size();)
+    {
+        unsigned stripeIndex = stripeOf(wanted[i]);
+        LockStripe& stripe = m_stripes[stripeIndex];
+        std::lock_guard<std::mutex> stripeGuard(stripe.mutex);
+        for (; i < wanted.size() && stripeOf(wanted[i]) == stripeIndex; ++i)
+        {
+            auto it = stripe.locks.find(wanted[i]);
+            if (it == stripe.locks.end() || it->second.isIdle)
+                continue;
+
+            Lock& lock = it->second;
+            report.locks.push_back(DeadlockReport::LockState{lock.p, lock.isRecursive, lock.isReadWriteLock, lock.firstSite});
+        }
+    }
+}
+
+void DeadlockChecker::reportError(DeadlockChecker::DeadlockReport &report, DeadlockReport::Kind kind, void *p,
+    const SourceSite* site)
+{
+    report.kind = kind;
+    report.p = p;
+    report.site = site;
+}
+
+void DeadlockChecker::reportOrderInversion(DeadlockChecker::DeadlockReport &report, void *p, const SourceSite* site,
+    void *held, const std::vector<std::pair<void*, void*>>& cycle, const DeadlockChecker::LockPath &path)
+{
+    report.kind = DeadlockReport::REPORT_ORDER_INVERSION;
+    report.p = p;
+    report.site = site;
+    report.held = held;
+
+    for (auto& edge : cycle)
+    {
+        const OrderNode& orderNode = m_orderGraph[edge.first];
+        const OrderEdge& orderEdge = orderNode.after.find(edge.second)->second;
+        report.order.push_back(DeadlockReport::OrderStep{orderNode.name, m_orderGraph[edge.second].name, orderEdge.site});
+    }
+
+    report.threads.resize(1);
+    snapshotOf(path, report.threads[0]);
+}
+
+void DeadlockChecker::snapshotOf(const DeadlockChecker::LockPath &path, DeadlockReport::ThreadState &state)
+{
+    state.threadID = path.threadID;
+
+    state.history.reserve(path.path.size());
+    for (size_t i = 0; i < path.path.size(); ++i)
+    {
+        const PositionLock& pos = path.path.newest(i);
+        state.history.push_back(DeadlockReport::Action{pos.p, pos.site, pos.flagLock, pos.isLockAction});
+    }
+
+    state.held.reserve(path.count.size());
+    for (auto& it : path.count)
+    {
+        state.held.push_back(DeadlockReport::HeldLock{it.first, it.second.c[INDEX_COUNT_DEFAULT],
+                                                      it.second.c[INDEX_COUNT_READ], it.second.c[INDEX_COUNT_WRITE]});
+    }
+}
+
+bool DeadlockChecker::formatReport(bool ret, const DeadlockChecker::DeadlockReport &report, std::string &err)
+{
+    if (!ret)
+        err = report.toString();
+
+    return ret;
+}
+
+std::string DeadlockChecker::stringOfSite(const DeadlockChecker::SourceSite *site)
+{
+    return std::string(site->filename).append(":").append(std::to_string(site->line));
+}
+
+std::string DeadlockChecker::stringOfThread(const DeadlockReport::ThreadState &state)
+{
+    char buf[256] = {0};
+    const char* hintIsLockAction[] = { "unlock", "lock"};
+    const char* hintFlagLock[FLAG_DEFAULT | FLAG_READ | FLAG_WRITE];
+    hintFlagLock[FLAG_DEFAULT] = "";
+    hintFlagLock[FLAG_READ] = "read";
+    hintFlagLock[FLAG_WRITE] = "write";
+
+    std::string ret = "Thread ";
+    sprintf(buf, "%x", state.threadID);
+    ret.append(buf).append(" :\n");
+    for (auto& action : state.history)
+    {
+        sprintf(buf, "  %8s %-8s %p", hintFlagLock[action.flagLock], hintIsLockAction[action.isLockAction], action.p);
+        ret.append(buf).append("  ");
+        ret.append(stringOfSite(action.site));
+        ret.append("\n");
+    }
+
+    ret.append("handling locks: \n");
+    if (state.held.empty())
+    {
+        ret.append("  empty\n");
+    }
+    else
+    {
+        for (auto& held : state.held)
+        {
+            sprintf(buf, "  %p default:%d, read:%d, write:%d\n", held.p,
+                    held.defaultCount, held.readCount, held.writeCount);
+            ret.append(buf);
+        }
+    }
+
+    if (state.waitingOn)
+    {
+        sprintf(buf, "waiting on %p for %lld ms\n", state.waitingOn, (long long)state.waitMilliseconds);
+        ret.append(buf);
+    }
+
+    return ret;
+}
+
+std::string DeadlockChecker::DeadlockReport::toString() const
+{
+    char buf[256] = {0};
+    std::string ret;
+
+    switch (kind)
+    {
+    case REPORT_FUNC_NOT_MATCHING:
+        ret.append(ERR_CHECK_FUNC_NOT_MATCHING).append(" (").append(stringOfSite(site)).append(")");
+        break;
+    case REPORT_INVALID_UNLOCK:
+        ret.append(ERR_UNLOCK_AN_INVALID_LOCK).append(" (").append(stringOfSite(site)).append(")");
+        break;
+    case REPORT_DEADLOCK:
+        sprintf(buf, "conflict from thread %x lock: %p", threads[0].threadID, p);
+        ret = buf;
+        ret.append(" (").append(stringOfSite(site));
+        if (*site->function)
+            ret.append(" in ").append(site->function);
+        ret.append(") \n");
+        for (auto& thread : threads)
+            ret.append(stringOfThread(thread));
+        ret.append("\n");
+
+        ret.append("lock list:\n");
+        for (auto& lock : locks)
+        {
+            sprintf(buf, "  %-8p", lock.p);
+            ret.append(buf);
+            if (lock.isRecursive)
+                ret.append(" recursive");
+            if (lock.isReadWriteLock)
+                ret.append(" read-write lock ");
+            else
+                ret.append(" default ");
+
+            ret.append(" (").append(stringOfSite(lock.firstSite)).append(")\n");
+        }
+        break;
+    case REPORT_ORDER_INVERSION:
+        sprintf(buf, "%s from thread %x lock: %p while holding %p", ERR_LOCK_ORDER_INVERSION, threads[0].threadID, p, held);
+        ret = buf;
+        ret.append(" (").append(stringOfSite(site));
+        if (*site->function)
+            ret.append(" in ").append(site->function);
+        ret.append(") \n");
+
+        ret.append("recorded order:\n");
+        for (auto& step : order)
+        {
+            ret.append("  ").append(step.from).append(" -> ").append(step.to).append("  ");
+            ret.append(stringOfSite(step.site));
+            ret.append("\n");
+        }
+        ret.append(stringOfThread(threads[0]));
+        break;
+    case REPORT_THREAD_EXIT:
+        sprintf(buf, "%s, thread %x\n", ERR_THREAD_EXIT_HOLDING_LOCKS, threads[0].threadID);
+        ret = buf;
+        ret.append(stringOfThread(threads[0]));
+        break;
+    case REPORT_WAIT_CYCLE:
+        sprintf(buf, "%s of %d threads\n", ERR_WAIT_CYCLE, (int)threads.size());
+        ret = buf;
+        for (auto& thread : threads)
+            ret.append(stringOfThread(thread));
+        break;
+    case REPORT_STALL:
+        sprintf(buf, "%s, thread %x on lock %p for %lld ms\n", ERR_STALL, threads[0].threadID, p,
+                (long long)threads[0].waitMilliseconds);
+        ret = buf;
+        for (auto& thread : threads)
+            ret.append(stringOfThread(thread));
+        break;
+    case REPORT_LONG_HOLD:
+        sprintf(buf, "%s, lock %p held for %.3f ms, taken at ", ERR_LONG_HOLD, p, heldMicroseconds / 1e3);
+        ret = buf;
+        ret.append(stringOfSite(site)).append("\n");
+        ret.append(stringOfThread(threads[0]));
+        break;
+    case REPORT_LEVEL_INVERSION:
+        sprintf(buf, "%s from thread %x lock: %p at level %u while holding %p at level %u\n", ERR_LEVEL_INVERSION,
+                threads[0].threadID, p, level, held, heldLevel);
+        ret = buf;
+        break;
+    default:
+        break;
+    }
+
+    return ret;
+}
+
+std::string DeadlockChecker::DeadlockReport::toJson() const
+{
+    const char* hintKind[] = {"none", "func-not-matching", "invalid-unlock", "deadlock", "order-inversion",
+                              "thread-exit", "wait-cycle", "stall", "long-hold", "level-inversion"};
+    const char* hintFlagLock[FLAG_DEFAULT | FLAG_READ | FLAG_WRITE];
+    hintFlagLock[FLAG_DEFAULT] = "default";
+    hintFlagLock[FLAG_READ] = "read";
+    hintFlagLock[FLAG_WRITE] = "write";
+
+    std::string ret = "{\"kind\":";
+    ret.append(jsonOfString(hintKind[kind]));
+    ret.append(",\"lock\":").append(jsonOfPointer(p));
+    ret.append(",\"site\":").append(jsonOfSite(site));
+    if (held)
+        ret.append(",\"held\":").append(jsonOfPointer(held));
+    if (kind == REPORT_LONG_HOLD)
+        ret.append(",\"heldUs\":").append(std::to_string(heldMicroseconds));
+    if (kind == REPORT_LEVEL_INVERSION)
+    {
+        ret.append(",\"level\":").append(std::to_string(level));
+        ret.append(",\"heldLevel\":").append(std::to_string(heldLevel));
+    }
+
+    ret.append(",\"threads\":[");
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        const ThreadState& thread = threads[i];
+        ret.append(i ? ",{" : "{").append("\"thread\":").append(std::to_string(thread.threadID));
+        if (thread.waitingOn)
+        {
+            ret.append(",\"waitingOn\":").append(jsonOfPointer(thread.waitingOn));
+            ret.append(",\"waitMs\":").append(std::to_string(thread.waitMilliseconds));
+        }
 
-DeadlockChecker* DeadlockChecker::s_this = NULL;
+        ret.append(",\"history\":[");
+        for (size_t j = 0; j < thread.history.size(); ++j)
+        {
+            const Action& action = thread.history[j];
+            ret.append(j ? ",{" : "{");
+            ret.append("\"action\":").append(action.isLockAction ? "\"lock\"" : "\"unlock\"");
+            ret.append(",\"mode\":").append(jsonOfString(hintFlagLock[action.flagLock]));
+            ret.append(",\"lock\":").append(jsonOfPointer(action.p));
+            ret.append(",\"site\":").append(jsonOfSite(action.site)).append("}");
+        }
 
-void DeadlockChecker::init()
-{
-    if (!s_this)
-        s_this = new DeadlockChecker();
-}
+        ret.append("],\"held\":[");
+        for (size_t j = 0; j < thread.held.size(); ++j)
+        {
+            const HeldLock& heldLock = thread.held[j];
+            ret.append(j ? ",{" : "{");
+            ret.append("\"lock\":").append(jsonOfPointer(heldLock.p));
+            ret.append(",\"default\":").append(std::to_string(heldLock.defaultCount));
+            ret.append(",\"read\":").append(std::to_string(heldLock.readCount));
+            ret.append(",\"write\":").append(std::to_string(heldLock.writeCount)).append("}");
+        }
+        ret.append("]}");
+    }
 
-DeadlockChecker *DeadlockChecker::share()
-{
-    return s_this;
-}
+    ret.append("],\"locks\":[");
+    for (size_t i = 0; i < locks.size(); ++i)
+    {
+        const LockState& lock = locks[i];
+        ret.append(i ? ",{" : "{");
+        ret.append("\"lock\":").append(jsonOfPointer(lock.p));
+        ret.append(",\"recursive\":").append(lock.isRecursive ? "true" : "false");
+        ret.append(",\"readWrite\":").append(lock.isReadWriteLock ? "true" : "false");
+        ret.append(",\"site\":").append(jsonOfSite(lock.firstSite)).append("}");
+    }
 
-void DeadlockChecker::release()
-{
-    delete s_this;
-    s_this = NULL;
-}
+    ret.append("],\"order\":[");
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        const OrderStep& step = order[i];
+        ret.append(i ? ",{" : "{");
+        ret.append("\"from\":").append(jsonOfString(step.from));
+        ret.append(",\"to\":").append(jsonOfString(step.to));
+        ret.append(",\"site\":").append(jsonOfSite(step.site)).append("}");
+    }
+    ret.append("]}");
 
-void DeadlockChecker::lock()
-{
-    m_mutex.lock();
+    return ret;
 }
 
-void DeadlockChecker::unlock()
+uint64_t DeadlockChecker::ContentionProfile::Entry::percentile(double fraction) const
 {
-    m_mutex.unlock();
-}
+    uint64_t total = 0;
+    for (uint64_t count : histogram)
+        total += count;
 
-bool DeadlockChecker::checkLock(void *p, const char *filename, int line, std::string &err)
-{
-    return doCheckLock(p, filename, line, err, FLAG_DEFAULT, false);
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i)
+    {
+        seen += histogram[i];
+        if (seen && seen >= fraction * total)
+            return i + 1 < BUCKETS ? std::min((uint64_t)1 << (i + 1), maxNanoseconds) : maxNanoseconds;
+    }
+    return 0;
 }
 
-bool DeadlockChecker::checkRecursiveLock(void *p, const char *filename, int line, std::string &err)
+std::string DeadlockChecker::ContentionProfile::toString(size_t top) const
 {
-    return doCheckLock(p, filename, line, err, FLAG_DEFAULT, true);
-}
+    char buf[256] = {0};
+    std::string ret;
+    const std::vector<Entry>* lists[] = {&sites, &locks};
+    for (const std::vector<Entry>* entries : lists)
+    {
+        ret.append(entries == &sites ? "contended sites:\n" : "contended locks:\n");
+        sprintf(buf, "  %12s %10s %10s %12s %10s %10s %10s  %s\n", "acquisitions", "contended", "try-failed",
+                "wait-ms", "max-us", "p50-us", "p99-us", entries == &sites ? "site" : "lock");
+        ret.append(buf);
+        for (size_t i = 0; i < entries->size() && i < top; ++i)
+        {
+            const Entry& entry = (*entries)[i];
+            sprintf(buf, "  %12llu %10llu %10llu %12.3f %10.1f %10.1f %10.1f  ", (unsigned long long)entry.acquisitions,
+                    (unsigned long long)entry.contentions, (unsigned long long)entry.tryFailures,
+                    entry.waitNanoseconds / 1e6, entry.maxNanoseconds / 1e3, entry.percentile(0.5) / 1e3,
+                    entry.percentile(0.99) / 1e3);
+            ret.append(buf);
+            if (entry.site)
+            {
+                ret.append(stringOfSite(entry.site));
+            }
+            else
+            {
+                sprintf(buf, "%p", entry.p);
+                ret.append(buf);
+            }
+            ret.append("\n");
+        }
+    }
 
-bool DeadlockChecker::checkUnlock(void *p, const char *filename, int line, std::string &err)
-{
-    return doCheckUnlock(p, filename, line, err, FLAG_DEFAULT);
+    return ret;
 }
 
-bool DeadlockChecker::checkReadLock(void *p, const char *filename, int line, std::string &err)
+std::string DeadlockChecker::HoldProfile::toString(size_t top) const
 {
-    return doCheckLock(p, filename, line, err, FLAG_READ, false);
-}
+    char buf[256] = {0};
+    std::string ret = "longest held sites:\n";
+    sprintf(buf, "  %12s %10s %12s %10s %10s %10s  %s\n", "acquisitions", "long", "held-ms", "max-us", "p50-us",
+            "p99-us", "site");
+    ret.append(buf);
+    for (size_t i = 0; i < sites.size() && i < top; ++i)
+    {
+        const ContentionProfile::Entry& entry = sites[i];
+        sprintf(buf, "  %12llu %10llu %12.3f %10.1f %10.1f %10.1f  ", (unsigned long long)entry.acquisitions,
+                (unsigned long long)entry.contentions, entry.waitNanoseconds / 1e6, entry.maxNanoseconds / 1e3,
+                entry.percentile(0.5) / 1e3, entry.percentile(0.99) / 1e3);
+        ret.append(buf).append(stringOfSite(entry.site)).append("\n");
+    }
 
-bool DeadlockChecker::checkRecursiveReadLock(void *p, const char *filename, int line, std::string &err)
-{
-    return doCheckLock(p, filename, line, err, FLAG_READ, true);
+    return ret;
 }
 
-bool DeadlockChecker::checkReadUnlock(void *p, const char *filename, int line, std::string &err)
+void *DeadlockChecker::classOfLock(void *p, const SourceSite* site)
 {
-    return doCheckUnlock(p, filename, line, err, FLAG_READ);
-}
+    std::lock_guard<std::mutex> classGuard(m_classMutex);
 
-bool DeadlockChecker::checkWriteLock(void *p, const char *filename, int line, std::string &err)
-{
-    return doCheckLock(p, filename, line, err, FLAG_WRITE, false);
-}
+    void* lockClass = NULL;
+    switch (m_lockClassMode)
+    {
+    case LOCK_CLASS_BY_ADDRESS:
+        return p;
+    case LOCK_CLASS_BY_TAG:
+    {
+        auto it = m_lockTags.find(p);
+        if (it != m_lockTags.end())
+        {
+            lockClass = (void*)it->second;
+            if (!m_lockClassNames.count(lockClass))
+                m_lockClassNames[lockClass] = *it->second;
+            return lockClass;
+        }
+        break;
+    }
+    case LOCK_CLASS_BY_TYPE:
+        if (site->type)
+        {
+            lockClass = (void*)site->type;
+            if (!m_lockClassNames.count(lockClass))
+                m_lockClassNames[lockClass] = site->type->name();
+            return lockClass;
+        }
+        break;
+    default:
+        break;
+    }
 
-bool DeadlockChecker::checkRecursiveWriteLock(void *p, const char *filename, int line, std::string &err)
-{
-    return doCheckLock(p, filename, line, err, FLAG_WRITE, true);
-}
+    // untagged or untyped locks fall back to the site they were first taken at,
+    // the caller holds the stripe of p
+    LockStripe& stripe = m_stripes[stripeOf(p)];
+    auto itSite = stripe.firstSites.find(p);
+    if (itSite == stripe.firstSites.end())
+        itSite = stripe.firstSites.insert(std::make_pair(p, site)).first;
+    site = itSite->second;
 
-bool DeadlockChecker::checkWriteUnlock(void *p, const char *filename, int line, std::string &err)
-{
-    return doCheckUnlock(p, filename, line, err, FLAG_WRITE);
-}
+    lockClass = (void*)site;
+    if (!m_lockClassNames.count(lockClass))
+        m_lockClassNames[lockClass] = stringOfSite(site);
 
-DeadlockChecker::Lock &DeadlockChecker::getLock(void* p, bool isRecursive, bool isReadWriteLock, const char *filename, int line)
-{
-    return m_locks.insert(std::make_pair(p, Lock{p, isRecursive, isReadWriteLock, SourceCodePosition{filename, line},
-        std::map<ThreadID, int>(), std::map<ThreadID, int>(), std::map<ThreadID, int>()})).first->second;
+    return lockClass;
 }
 
-DeadlockChecker::Lock &DeadlockChecker::getLock(void *p)
+std::string DeadlockChecker::nameOfLockClass(void *lockClass)
 {
-    auto it = m_locks.find(p);
-    assert(it != m_locks.end());
-
-    return it->second;
-}
+    std::lock_guard<std::mutex> classGuard(m_classMutex);
 
-DeadlockChecker::ThreadID DeadlockChecker::getCurrentThreadID()
-{
-#if defined(_WIN32) || defined(_WIN64)
-    return GetCurrentThreadId();
-#else
-    return syscall(SYS_gettid);
-#endif
-}
+    auto it = m_lockClassNames.find(lockClass);
+    if (it != m_lockClassNames.end())
+        return it->second;
 
-DeadlockChecker::LockPath &DeadlockChecker::getLockPath(DeadlockChecker::ThreadID currentthreadID)
-{
-    return m_lockPath.insert(std::make_pair(currentthreadID, LockPath())).first->second;
+    char buf[32] = {0};
+    sprintf(buf, "%p", lockClass);
+    return buf;
 }
 
-bool DeadlockChecker::isIntersect(const LockPath& path, void* p, int flagLock, const LockPath &path2)
+bool DeadlockChecker::findOrderPath(void *from, void *to, std::vector<std::pair<void *, void *>> &edges)
 {
-    if (path2.count.size() < 2 || path.count.empty())
-        return false;
+    std::unordered_map<void*, void*> parents;
+    std::deque<void*> queue;
 
-    if (path2.path.back().p == p)
-        return false;
+    parents[from] = NULL;
+    queue.push_back(from);
+    while (!queue.empty())
+    {
+        void* current = queue.front();
+        queue.pop_front();
 
-    auto it1 = path2.count.find(p);
-    if (it1 == path2.count.end())
-        return false;
+        auto itNode = m_orderGraph.find(current);
+        if (itNode == m_orderGraph.end())
+            continue;
 
-    auto it2 = path.count.find(path2.path.back().p);
-    if (it2 == path.count.end())
-        return false;
+        for (auto& it : itNode->second.after)
+        {
+            void* next = it.first;
+            if (!parents.insert(std::make_pair(next, current)).second)
+                continue;
 
-    if (flagLock == FLAG_READ && !it2->second.c[INDEX_COUNT_WRITE]
-            && !it1->second.c[INDEX_COUNT_WRITE] && path2.path.back().flagLock != FLAG_WRITE)
-        return false;
+            if (next == to)
+            {
+                for (void* v = to; v != from; v = parents[v])
+                    edges.push_back(std::make_pair(parents[v], v));
+                std::reverse(edges.begin(), edges.end());
+                return true;
+            }
+            queue.push_back(next);
+        }
+    }
 
-    return true;
+    return false;
 }
 
-std::string DeadlockChecker::stringOfDeadlock(void *p, const char *filename, int line,
-    DeadlockChecker::ThreadID threadID1, const DeadlockChecker::LockPath &path1,
-    DeadlockChecker::ThreadID threadID2, const DeadlockChecker::LockPath &path2)
+bool DeadlockChecker::checkLockOrder(const DeadlockChecker::Lock& lock, const SourceSite* site, DeadlockChecker::LockPath &path, DeadlockReport &report)
 {
-    char buf[256] = {0};
+    size_t generation = m_orderGeneration.load(std::memory_order_acquire);
+    if (path.knownOrderGeneration != generation || path.knownOrder.size() >= KNOWN_ORDER_LIMIT)
+    {
+        path.knownOrder.clear();
+        path.knownOrderGeneration = generation;
+    }
+
+    // the same nesting again only needs the thread's own cache
+    void* lockClass = lock.lockClass;
+    bool isKnown = true;
+    for (auto& it : path.count)
+    {
+        void* heldClass = it.second.lockClass;
+        if (it.first != lock.p && heldClass != lockClass && !path.knownOrder.count(OrderKey{heldClass, lockClass}))
+        {
+            isKnown = false;
+            break;
+        }
+    }
 
-    sprintf(buf, "conflict from thread %x lock: %p", getCurrentThreadID(), p);
+    if (isKnown)
+        return true;
 
-    std::string ret = buf;
-    ret.append(" (").append(filename).append(":").append(std::to_string(line)).append(") \n");
-    ret.append(stringOfDeadlock(threadID1, path1));
-    ret.append(stringOfDeadlock(threadID2, path2));
-    ret.append("\n");
+    std::lock_guard<std::mutex> orderGuard(m_orderMutex);
 
-    ret.append("lock list:\n");
-    for (auto it : m_locks)
+    generation = m_orderGeneration.load(std::memory_order_relaxed);
+    if (path.knownOrderGeneration != generation)
     {
-        Lock& lock = it.second;
-        sprintf(buf, "  %-8p", lock.p);
-        ret.append(buf);
-        if (lock.isRecursive)
-            ret.append(" recursive");
-        if (lock.isReadWriteLock)
-            ret.append(" read-write lock ");
-        else
-            ret.append(" default ");
+        path.knownOrder.clear();
+        path.knownOrderGeneration = generation;
+    }
+
+    bool ret = true;
+    std::vector<void*> newEdges;
+    for (auto& it : path.count)
+    {
+        void* held = it.first;
+        if (held == lock.p)
+            continue;
+
+        // two locks of one class taken together can not be ordered by class
+        void* heldClass = it.second.lockClass;
+        if (heldClass == lockClass)
+            continue;
+
+        OrderKey key = OrderKey{heldClass, lockClass};
+        auto itNode = m_orderGraph.find(heldClass);
+        if ((itNode != m_orderGraph.end() && itNode->second.after.count(lockClass)) || m_reportedInversions.count(key))
+        {
+            path.knownOrder.insert(std::make_pair(key, true));
+            continue;
+        }
 
-        ret.append(" (").append(lock.firstPos.filename).append(":").append(std::to_string(lock.firstPos.line)).append(")\n");
+        std::vector<std::pair<void*, void*>> cycle;
+        if (findOrderPath(lockClass, heldClass, cycle))
+        {
+            // reported once, the inverted edge stays out of the graph
+            if (ret)
+                reportOrderInversion(report, lock.p, site, held, cycle, path);
+            m_reportedInversions.insert(std::make_pair(key, true));
+            path.knownOrder.insert(std::make_pair(key, true));
+            ret = false;
+            continue;
+        }
+        newEdges.push_back(heldClass);
+    }
+
+    if (newEdges.empty())
+        return ret;
 
+    OrderNode& node = orderNodeOf(lockClass);
+    for (void* heldClass : newEdges)
+    {
+        OrderNode& heldNode = orderNodeOf(heldClass);
+        heldNode.after.insert(std::make_pair(lockClass, OrderEdge{site}));
+        node.before.insert(std::make_pair(heldClass, true));
+        path.knownOrder.insert(std::make_pair(OrderKey{heldClass, lockClass}, true));
     }
 
     return ret;
 }
 
-std::string DeadlockChecker::stringOfDeadlock(DeadlockChecker::ThreadID currentthreadID, const DeadlockChecker::LockPath &path)
+DeadlockChecker::OrderNode &DeadlockChecker::orderNodeOf(void *lockClass)
 {
-    char buf[256] = {0};
-    const char* hintIsLockAction[] = { "unlock", "lock"};
-    const char* hintFlagLock[FLAG_DEFAULT | FLAG_READ | FLAG_WRITE];
-    hintFlagLock[FLAG_DEFAULT] = "";
-    hintFlagLock[FLAG_READ] = "read";
-    hintFlagLock[FLAG_WRITE] = "write";
-
-    std::string ret = "Thread ";
-    sprintf(buf, "%x", currentthreadID);
-    ret.append(buf).append(" :\n");
-    for (auto it = path.path.rbegin(); it != path.path.rend(); ++it)
+    OrderNode& node = m_orderGraph[lockClass];
+    if (node.name.empty())
     {
-        const PositionLock& pos = *it;
-        sprintf(buf, "  %8s %-8s %p", hintFlagLock[pos.flagLock], hintIsLockAction[pos.isLockAction], pos.p);
-        ret.append(buf).append("  ");
-        ret.append(pos.pos.filename).append(":").append(std::to_string(pos.pos.line));
-        ret.append("\n");
+        node.name = nameOfLockClass(lockClass);
+
+        // removeLock only looks for the node of an address class if its stripe has any
+        if (m_lockClassMode == LOCK_CLASS_BY_ADDRESS)
+            m_stripes[stripeOf(lockClass)].orderNodeCount.fetch_add(1, std::memory_order_release);
     }
 
-    ret.append("handling locks: \n");
-    if (path.count.empty())
+    return node;
+}
+
+void DeadlockChecker::dropOrderNode(void *p)
+{
+    std::lock_guard<std::mutex> orderGuard(m_orderMutex);
+
+    // only address classes belong to one lock
+    if (m_lockClassMode != LOCK_CLASS_BY_ADDRESS)
+        return;
+
+    auto itNode = m_orderGraph.find(p);
+    if (itNode == m_orderGraph.end())
+        return;
+
+    bool hasEdges = !itNode->second.after.empty() || !itNode->second.before.empty();
+    for (auto& it : itNode->second.after)
     {
-        ret.append("  empty\n");
+        auto itAfter = m_orderGraph.find(it.first);
+        if (itAfter != m_orderGraph.end())
+            itAfter->second.before.erase(p);
     }
-    else
+    for (auto& it : itNode->second.before)
     {
-        for (auto it : path.count)
-        {
-            sprintf(buf, "  %p default:%d, read:%d, write:%d\n", it.first,
-                    it.second.c[INDEX_COUNT_DEFAULT], it.second.c[INDEX_COUNT_READ],
-                    it.second.c[INDEX_COUNT_WRITE]);
-            ret.append(buf);
-        }
+        auto itBefore = m_orderGraph.find(it.first);
+        if (itBefore != m_orderGraph.end())
+            itBefore->second.after.erase(p);
     }
+    m_orderGraph.erase(itNode);
+    m_stripes[stripeOf(p)].orderNodeCount.fetch_sub(1, std::memory_order_relaxed);
 
-    return ret;
+    std::vector<OrderKey> dropped;
+    for (auto& it : m_reportedInversions)
+    {
+        if (it.first.before == p || it.first.after == p)
+            dropped.push_back(it.first);
+    }
+    for (auto& key : dropped)
+        m_reportedInversions.erase(key);
+
+    // the threads' caches may hold edges of the dropped node
+    if (hasEdges || !dropped.empty())
+        m_orderGeneration.fetch_add(1, std::memory_order_release);
 }
 
-std::string DeadlockChecker::stringOfError(const char *err, const char *filename, int line)
+void DeadlockChecker::addHistory(DeadlockChecker::LockPath &path, const DeadlockChecker::PositionLock &pos)
 {
-    std::string ret;
-    ret.append(err).append(" (").append(filename).append(":").append(std::to_string(line)).append(")");
+    // a changed depth is picked up by each thread on its next event
+    size_t depth = m_historyDepth.load(std::memory_order_relaxed);
+    if (path.path.capacity() != depth)
+        path.path.resize(depth);
 
-    return ret;
+    path.path.push(pos);
 }
 
-void DeadlockChecker::record(ThreadID threadID, void *p, const char *filename,
-    int line, std::map<ThreadID, int> &counter, DeadlockChecker::LockPath &path, int flagLock)
+void DeadlockChecker::record(const DeadlockChecker::Lock &lock, const SourceSite* site, DeadlockChecker::LockPath &path, int flagLock)
 {
-    path.path.push_back(PositionLock{p, SourceCodePosition{filename, line}, flagLock, true});
-    if (path.path.size() > MAX_PATH_LEN)
-        path.path.pop_front();
+    void* p = lock.p;
+    std::lock_guard<std::mutex> pathGuard(path.mutex);
+
+    addHistory(path, PositionLock{p, site, flagLock, true});
+
+    auto result = path.count.insert(std::make_pair(p, LockPath::Count()));
+    if (result.second)
+    {
+        result.first->second.lockClass = lock.lockClass;
+        if (m_holdTracking.load(std::memory_order_relaxed))
+        {
+            result.first->second.since = path.replayTime ? path.replayTime : nowNanoseconds();
+            result.first->second.site = site;
+        }
 
-    LockPath::Count& c = path.count.insert(std::make_pair(p, LockPath::Count{0})).first->second;
+        unsigned stripe = stripeOf(p);
+        if (!path.stripeHeld[stripe]++)
+            path.heldStripes |= (uint64_t)1 << stripe;
+    }
+
+    LockPath::Count& c = result.first->second;
     switch (flagLock)
     {
     case FLAG_DEFAULT:
@@ -246,68 +2213,125 @@ void DeadlockChecker::record(ThreadID threadID, void *p, const char *filename,
         assert(0);
     }
     c.c[INDEX_COUNT_ALL]++;
-
-    counter.insert(std::make_pair(threadID, 0)).first->second++;
 }
 
-bool DeadlockChecker::doCheckLock(void *p, const char *filename, int line, std::string &err, int flagLock, bool isRecursive)
+bool DeadlockChecker::doCheckLock(void *p, const SourceSite* site, DeadlockReport &report, int flagLock, bool isRecursive)
 {
-    ThreadID currentthreadID = getCurrentThreadID();
-    return doCheckLock(p, filename, line, err, flagLock, isRecursive, currentthreadID);
-}
+    if (m_asyncMode.load(std::memory_order_relaxed))
+    {
+        pushEvent(p, site, flagLock, isRecursive, true);
+        return true;
+    }
 
-bool DeadlockChecker::doCheckUnlock(void *p, const char *filename, int line, std::string &err, int flagLock)
-{
-    ThreadID currentthreadID = getCurrentThreadID();
-    return doCheckUnlock(p, filename, line, err, flagLock, currentthreadID);
+    LockPath& currentLockPath = getCurrentLockPath();
+    SiteSample* sample = NULL;
+    size_t signature = 0;
+    if (!shouldCheck(p, site, currentLockPath, sample, signature))
+    {
+        forceRecord(p, site, flagLock, isRecursive, currentLockPath);
+        currentLockPath.skippedCount.store(currentLockPath.skippedCount.load(std::memory_order_relaxed) + 1,
+                                           std::memory_order_relaxed);
+        return true;
+    }
+
+    bool ret = doCheckLock(p, site, report, flagLock, isRecursive, currentLockPath);
+    if (!ret && report.kind == DeadlockReport::REPORT_DEADLOCK)
+        collectLocks(report);
+    currentLockPath.checkedCount.store(currentLockPath.checkedCount.load(std::memory_order_relaxed) + 1,
+                                       std::memory_order_relaxed);
+    if (sample)
+    {
+        if (!ret)
+        {
+            sample->cleanStreak = 0;
+        }
+        else if (signature == sample->lastSignature)
+        {
+            sample->cleanStreak++;
+        }
+        else
+        {
+            sample->lastSignature = signature;
+            sample->cleanStreak = 1;
+        }
+    }
+
+    return ret;
 }
 
-bool DeadlockChecker::doCheckLock(void *p, const char *filename, int line, std::string &err, int flagLock,
-    bool isRecursive, DeadlockChecker::ThreadID currentthreadID)
+bool DeadlockChecker::shouldCheck(void *p, const DeadlockChecker::SourceSite *site, DeadlockChecker::LockPath &path,
+    DeadlockChecker::SiteSample *&sample, size_t &signature)
 {
-    std::lock_guard<std::recursive_mutex> lockGuard(m_mutex);
+    unsigned sampleRate = m_sampleRate.load(std::memory_order_relaxed);
+    unsigned cleanOrderLimit = m_cleanOrderLimit.load(std::memory_order_relaxed);
+    if (sampleRate <= 1 && !cleanOrderLimit)
+        return true;
 
-    bool isReadWriteLock = flagLock != FLAG_DEFAULT;
-    Lock& lock = getLock(p, isRecursive, isReadWriteLock, filename, line);
-    if (lock.isReadWriteLock != isReadWriteLock || lock.isRecursive != isRecursive)
+    sample = &path.samples[site];
+    if (cleanOrderLimit)
     {
-        err = stringOfError(ERR_CHECK_FUNC_NOT_MATCHING, filename, line);
-        return false;
+        // the held set is what decides whether this acquisition can conflict
+        signature = flatHashOf(p);
+        for (auto& it : path.count)
+            signature ^= flatHashOf(it.first) * 31;
+
+        if (signature == sample->lastSignature && sample->cleanStreak >= cleanOrderLimit)
+            return false;
     }
-    LockPath& currentLockPath = getLockPath(currentthreadID);
 
-    std::map<ThreadID, int> *dstCounter = NULL;
-    std::vector<std::map<ThreadID, int>*> vec(2);
-    vec.resize(0);
-    switch(flagLock)
+    if (sampleRate > 1 && sample->acquisitions++ % sampleRate)
+        return false;
+
+    return true;
+}
+
+bool DeadlockChecker::doCheckUnlock(void *p, const SourceSite* site, DeadlockReport &report, int flagLock)
+{
+    if (m_asyncMode.load(std::memory_order_relaxed))
     {
-    case FLAG_DEFAULT:
-        vec.push_back(&lock.countLock);
-        dstCounter = &lock.countLock;
-        break;
-    case FLAG_READ:
-        vec.push_back(&lock.countWriteLock);
-        vec.push_back(&lock.countReadLock);
-        dstCounter = &lock.countReadLock;
-        break;
-    case FLAG_WRITE:
-        vec.push_back(&lock.countWriteLock);
-        vec.push_back(&lock.countReadLock);
-        dstCounter = &lock.countWriteLock;
-        break;
-    default:
-        assert(0);
+        pushEvent(p, site, flagLock, false, false);
+        return true;
     }
 
-    if (!currentLockPath.count.empty())
+    return doCheckUnlock(p, site, report, flagLock, getCurrentLockPath());
+}
+
+bool DeadlockChecker::doCheckLock(void *p, const SourceSite* site, DeadlockReport &report, int flagLock,
+    bool isRecursive, DeadlockChecker::LockPath& currentLockPath)
+{
+    unsigned currentThreadIndex = currentLockPath.threadIndex;
+    uint64_t heldMask = currentLockPath.heldStripes | stripeBit(p);
+    uint64_t mask = stripeBit(p);
+    DeadlockReport inversion;
+    for (;;)
     {
-        for (std::map<ThreadID, int>* counter : vec)
+        // two acquisitions only deadlock each other if each wants a lock the other
+        // holds. A wanted lock without other holders needs just its own stripe,
+        // otherwise the stripes of all held locks are taken too, so such a pair
+        // shares stripes and is checked one after the other
+        StripeGuard stripeGuard(*this, mask);
+
+        bool isReadWriteLock = flagLock != FLAG_DEFAULT;
+        Lock& lock = getLock(p, isRecursive, isReadWriteLock, site);
+        if (lock.isReadWriteLock != isReadWriteLock || lock.isRecursive != isRecursive)
+        {
+            reportError(report, DeadlockReport::REPORT_FUNC_NOT_MATCHING, p, site);
+            return false;
+        }
+
+        if (!currentLockPath.count.empty())
         {
-            for (auto itThread : *counter)
+            if (mask != heldMask && hasOtherHolder(lock, currentThreadIndex))
+            {
+                mask = heldMask;
+                continue;
+            }
+
+            for (HolderSet::Holder& holder : lock.holders)
             {
-                if (itThread.first == currentthreadID)
+                if (holder.thread == currentThreadIndex)
                 {
-                    std::map<void*, LockPath::Count>::const_iterator it = currentLockPath.count.find(p);
+                    auto it = currentLockPath.count.find(p);
                     if (it != currentLockPath.count.end())
                     {
                         if (flagLock == FLAG_READ)
@@ -317,45 +2341,84 @@ bool DeadlockChecker::doCheckLock(void *p, const char *filename, int line, std::
                         {
                             if (flagLock == FLAG_WRITE && !it->second.c[INDEX_COUNT_WRITE])
                             {
-                                err = stringOfDeadlock(p, filename, line, currentthreadID, currentLockPath, currentthreadID, currentLockPath);
+                                reportDeadlock(report, p, site, currentLockPath, currentLockPath);
                                 return false;
                             }
                         }
                         else
                         {
-                            err = stringOfDeadlock(p, filename, line, currentthreadID, currentLockPath, currentthreadID, currentLockPath);
+                            reportDeadlock(report, p, site, currentLockPath, currentLockPath);
                             return false;
                         }
                     }
                 }
                 else
                 {
-                    LockPath& tmpLockPath = getLockPath(itThread.first);
+                    LockPath& tmpLockPath = getLockPath(holder.thread);
+                    std::lock_guard<std::mutex> pathGuard(tmpLockPath.mutex);
                     if (isIntersect(currentLockPath, p, flagLock, tmpLockPath))
                     {
-                        err = stringOfDeadlock(p, filename, line, currentthreadID, currentLockPath, itThread.first, tmpLockPath);
+                        reportDeadlock(report, p, site, currentLockPath, tmpLockPath);
                         return false;
-
                     }
                 }
             }
         }
+
+        // an inversion is only a potential deadlock, the acquisition goes ahead
+        if (m_lockOrderCheck && !currentLockPath.count.empty())
+            checkLockOrder(lock, site, currentLockPath, inversion);
+
+        // other threads must see the counter and the path change under the same
+        // stripes, otherwise two crossing acquisitions can both miss each other
+        countOfHolder(lock.holders.get(currentThreadIndex), flagLock)++;
+        record(lock, site, currentLockPath, flagLock);
+        break;
     }
-    record(currentthreadID, p, filename, line, *dstCounter, currentLockPath, flagLock);
+
+    if (inversion.kind != DeadlockReport::REPORT_NONE)
+        deliverReport(inversion);
 
     return true;
 }
 
-bool DeadlockChecker::doCheckUnlock(void *p, const char *filename, int line, std::string &err, int flagLock, DeadlockChecker::ThreadID currentthreadID)
+bool DeadlockChecker::doRecordTryLock(void *p, const SourceSite* site, DeadlockReport &report, int flagLock,
+    bool isRecursive, DeadlockChecker::LockPath& currentLockPath)
 {
-    std::lock_guard<std::recursive_mutex> lockGuard(m_mutex);
+    StripeGuard stripeGuard(*this, stripeBit(p));
 
-    LockPath& currentLockPath = getLockPath(currentthreadID);
+    // the lock is already held, so a mismatch is reported but still recorded
+    // to keep the matching unlock valid
+    bool isReadWriteLock = flagLock != FLAG_DEFAULT;
+    Lock& lock = getLock(p, isRecursive, isReadWriteLock, site);
+    bool ret = lock.isReadWriteLock == isReadWriteLock && lock.isRecursive == isRecursive;
+    if (!ret)
+        reportError(report, DeadlockReport::REPORT_FUNC_NOT_MATCHING, p, site);
+
+    countOfHolder(lock.holders.get(currentLockPath.threadIndex), flagLock)++;
+    record(lock, site, currentLockPath, flagLock);
+
+    return ret;
+}
+
+bool DeadlockChecker::doCheckUnlock(void *p, const SourceSite* site, DeadlockReport &report, int flagLock, DeadlockChecker::LockPath& currentLockPath)
+{
+    unsigned currentThreadIndex = currentLockPath.threadIndex;
+    int64_t heldNanoseconds = 0;
+    const SourceSite* heldSite = NULL;
     {
+        std::unique_lock<std::mutex> pathGuard(currentLockPath.mutex);
+
         auto itCount = currentLockPath.count.find(p);
         if (itCount == currentLockPath.count.end())
         {
-            err = stringOfError(ERR_UNLOCK_AN_INVALID_LOCK, filename, line);
+            // taken before the checker was enabled
+            bool isEnabledLate = currentLockPath.isEnabledLate;
+            pathGuard.unlock();
+            if (isEnabledLate && isUntracked(p))
+                return true;
+
+            reportError(report, DeadlockReport::REPORT_INVALID_UNLOCK, p, site);
             return false;
         }
 
@@ -378,7 +2441,7 @@ bool DeadlockChecker::doCheckUnlock(void *p, const char *filename, int line, std
 
         if (!(*v))
         {
-            err = stringOfError(ERR_UNLOCK_AN_INVALID_LOCK, filename, line);
+            reportError(report, DeadlockReport::REPORT_INVALID_UNLOCK, p, site);
             return false;
         }
 
@@ -386,63 +2449,77 @@ bool DeadlockChecker::doCheckUnlock(void *p, const char *filename, int line, std
         --(count.c[INDEX_COUNT_ALL]);
         assert (count.c[INDEX_COUNT_ALL] >= 0);
         if (!count.c[INDEX_COUNT_ALL])
+        {
+            if (count.since)
+            {
+                heldSite = count.site;
+                heldNanoseconds = (currentLockPath.replayTime ? currentLockPath.replayTime : nowNanoseconds())
+                        - count.since;
+            }
             currentLockPath.count.erase(itCount);
 
-        currentLockPath.path.push_back(PositionLock{p, SourceCodePosition{ filename, line}, flagLock, false });
-        if (currentLockPath.path.size() > MAX_PATH_LEN)
-            currentLockPath.path.pop_front();
+            unsigned stripe = stripeOf(p);
+            if (!--currentLockPath.stripeHeld[stripe])
+                currentLockPath.heldStripes &= ~((uint64_t)1 << stripe);
+        }
+
+        addHistory(currentLockPath, PositionLock{p, site, flagLock, false });
     }
 
     {
-        Lock& lock = getLock(p);
-        std::map<ThreadID, int> *counter = NULL;
-        switch(flagLock)
-        {
-        case FLAG_DEFAULT:
-            counter = &lock.countLock;
-            break;
-        case FLAG_READ:
-            counter = &lock.countReadLock;
-            break;
-        case FLAG_WRITE:
-            counter = &lock.countWriteLock;
-            break;
-        default:
-            assert(0);
-        }
+        StripeGuard stripeGuard(*this, stripeBit(p));
 
-        auto itCount = counter->find(currentthreadID);
-        assert(itCount != counter->end());
+        Lock& lock = getLock(p);
+        HolderSet::Holder* holder = lock.holders.find(currentThreadIndex);
+        assert(holder);
 
-        itCount->second--;
-        assert(itCount->second >= 0);
+        unsigned& count = countOfHolder(*holder, flagLock);
+        assert(count > 0);
+        --count;
 
-        if (!itCount->second)
+        if (!holder->exclusive && !holder->shared)
         {
-            counter->erase(itCount);
-            if (flagLock == FLAG_DEFAULT)
-            {
-                if (lock.countLock.empty())
-                    m_locks.erase(p);
-            }
-            else
+            lock.holders.erase(holder);
+            // the entry stays in the table so the next acquisition does not insert again
+            if (lock.holders.empty())
             {
-                if (lock.countReadLock.empty() && lock.countWriteLock.empty())
-                    m_locks.erase(p);
+                lock.isIdle = true;
+                ++m_stripes[stripeOf(p)].idleLockCount;
             }
         }
     }
 
+    if (heldSite)
+        recordHold(currentLockPath, p, heldSite, heldNanoseconds);
+
     return true;
 }
 
 DeadlockChecker::DeadlockChecker()
+    :   m_lockPathCount(0),
+        m_generation(++s_generation),
+        m_lockOrderCheck(false),
+        m_orderGeneration(0),
+        m_lockClassMode(LOCK_CLASS_BY_ADDRESS),
+        m_historyDepth(DEFAULT_HISTORY_DEPTH),
+        m_sampleRate(1),
+        m_cleanOrderLimit(0),
+        m_watchdogStop(false),
+        m_watchdogInterval(100),
+        m_watchdogStall(0),
+        m_profileContended(1000),
+        m_holdTracking(false),
+        m_holdThreshold(0),
+        m_asyncMode(false),
+        m_asyncStalls(0),
+        m_analyzerStop(false)
 {
 
 }
 
 DeadlockChecker::~DeadlockChecker()
 {
-
+    setWatchdog(false);
+    setAsyncMode(false);
 }
 
@@ -3,172 +3,836 @@
 
 #include <string>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <set>
 #include <mutex>
 #include <memory>
-#include <list>
+#include <atomic>
+#include <tuple>
+#include <vector>
 #include <thread>
+#include <condition_variable>
+#include <functional>
+#include <typeinfo>
 #include <assert.h>
-
-#if defined(_WIN32) || defined(_WIN64)
-    #include <processthreadsapi.h>
-#else
-    #include <sys/syscall.h>
-    #include <unistd.h>
-#endif
+#include "CheckerAllocator.h"
+#include "FlatHashMap.h"
+#include "HolderSet.h"
+#include "ThreadIdentity.h"
 
 class DeadlockChecker
 {
-#if defined(_WIN32) || defined(_WIN64)
-    typedef DWORD ThreadID;
-#else
-    typedef __pid_t ThreadID;
-#endif
+public:
+    typedef ThreadIdentity::ThreadID ThreadID;
 
-    struct SourceCodePosition
+    enum LockClassMode
     {
-        std::string filename;
+        LOCK_CLASS_BY_ADDRESS,
+        LOCK_CLASS_BY_SITE,
+        LOCK_CLASS_BY_TAG,
+        LOCK_CLASS_BY_TYPE
+    };
+
+    enum SiteKind
+    {
+        SITE_LOCK       = 0,
+        SITE_UNLOCK     = 1,
+        SITE_TRY        = 2,
+        SITE_RECURSIVE  = 4,
+        SITE_READ       = 8,
+        SITE_WRITE      = 16,
+        SITE_UPGRADE    = 32,
+        SITE_DOWNGRADE  = 64
+    };
+
+    // one static instance per DEADLOCK_CHECK_* expansion, events only keep its address
+    struct SourceSite
+    {
+        const char* filename;
         int line;
+        const char* function;
+        int kind;
+        const std::type_info* type;
     };
 
+    // filled by the check functions while the checker is locked, the text is
+    // only built when the caller asks for it
+    struct DeadlockReport
+    {
+        enum Kind
+        {
+            REPORT_NONE,
+            REPORT_FUNC_NOT_MATCHING,
+            REPORT_INVALID_UNLOCK,
+            REPORT_DEADLOCK,
+            REPORT_ORDER_INVERSION,
+            REPORT_THREAD_EXIT,
+            REPORT_WAIT_CYCLE,
+            REPORT_STALL,
+            REPORT_LONG_HOLD,
+            REPORT_LEVEL_INVERSION
+        };
+
+        struct Action
+        {
+            void* p;
+            const SourceSite* site;
+            int flagLock;
+            bool isLockAction;
+        };
+
+        struct HeldLock
+        {
+            void* p;
+            int defaultCount;
+            int readCount;
+            int writeCount;
+        };
+
+        struct ThreadState
+        {
+            ThreadID threadID;
+            std::vector<Action> history;    // newest first
+            std::vector<HeldLock> held;
+            void* waitingOn;                // set by the watchdog for blocked threads
+            int64_t waitMilliseconds;
+
+            ThreadState() : threadID(0), waitingOn(NULL), waitMilliseconds(0) {}
+        };
+
+        struct LockState
+        {
+            void* p;
+            bool isRecursive;
+            bool isReadWriteLock;
+            const SourceSite* firstSite;
+        };
+
+        struct OrderStep
+        {
+            std::string from;
+            std::string to;
+            const SourceSite* site;
+        };
+
+        Kind kind;
+        void* p;
+        const SourceSite* site;
+        void* held;
+        std::vector<ThreadState> threads;
+        std::vector<LockState> locks;
+        std::vector<OrderStep> order;
+        int64_t heldMicroseconds;           // a long hold, site is where the lock was taken
+        unsigned level;                     // a level inversion, p is taken at level while holding held
+        unsigned heldLevel;
+
+        DeadlockReport() : kind(REPORT_NONE), p(NULL), site(NULL), held(NULL), heldMicroseconds(0), level(0),
+            heldLevel(0) {}
+
+        std::string toString() const;
+        std::string toJson() const;
+    };
+
+    struct StripeStats
+    {
+        size_t acquisitions;
+        size_t contentions;
+    };
+
+    // the per-thread wait profiles merged by site and by lock, longest total wait first
+    struct ContentionProfile
+    {
+        enum { BUCKETS = 32 };
+
+        struct Entry
+        {
+            const SourceSite* site;
+            void* p;
+            uint64_t acquisitions;
+            uint64_t contentions;   // waited at least the contention threshold
+            uint64_t tryFailures;
+            uint64_t waitNanoseconds;
+            uint64_t maxNanoseconds;
+            uint64_t histogram[BUCKETS];    // waits in [2^i, 2^(i+1)) ns, the last bucket takes the rest
+
+            // upper bound of the bucket holding that fraction of the acquisitions, at most the maximum
+            uint64_t percentile(double fraction) const;
+        };
+
+        std::vector<Entry> sites;
+        std::vector<Entry> locks;
+
+        std::string toString(size_t top = 10) const;
+    };
+
+    // the per-thread hold times merged by the site that took the lock. contentions
+    // counts the holds that reached the alert threshold, tryFailures is unused
+    struct HoldProfile
+    {
+        std::vector<ContentionProfile::Entry> sites;
+
+        std::string toString(size_t top = 10) const;
+    };
+
+private:
+    enum
+    {
+        LOCK_STRIPE_BITS = 6,
+        LOCK_STRIPE_COUNT = 1 << LOCK_STRIPE_BITS,
+        LOCK_PATH_CHUNK_SIZE = 256,
+        LOCK_PATH_CHUNKS = 4096
+    };
+
+    // bookkeeping containers allocate through the counting allocator
+    template<class T> using CheckerVector = std::vector<T, CheckerAllocator<T>>;
+    template<class K, class V> using CheckerMap = FlatHashMap<K, V, CheckerAllocator<std::pair<K, V>>>;
+    template<class K, class V> using CheckerHashMap = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>,
+                                                                         CheckerAllocator<std::pair<const K, V>>>;
+
+    // the first two holders live inline, which takes the entry past one cache
+    // line: 72 bytes on 64-bit targets, 80 per table slot with the key
     struct Lock
     {
         void* p;
+        const SourceSite* firstSite;
+        void* lockClass;
         bool isRecursive;
         bool isReadWriteLock;
-        SourceCodePosition firstPos;
+        bool isIdle;
 
-        std::map<ThreadID, int> countLock;
-        std::map<ThreadID, int> countReadLock;
-        std::map<ThreadID, int> countWriteLock;
+        HolderSet holders;
     };
 
 
     struct PositionLock
     {
         void* p;
-        SourceCodePosition pos;
+        const SourceSite* site;
         int flagLock;
         bool isLockAction;
     };
 
+    struct LockEvent
+    {
+        void* p;
+        const SourceSite* site;
+        int64_t timestamp;
+        short flagLock;
+        bool isRecursive;
+        bool isLockAction;
+    };
+
+    // written by the owning thread, drained by the analyzer thread. head frees the
+    // slots once copied, replayed follows once the copies went through the checker
+    struct EventQueue
+    {
+        CheckerVector<LockEvent> events;
+        std::atomic<size_t> head;
+        std::atomic<size_t> replayed;
+        char padding[64];
+        std::atomic<size_t> tail;
+
+        EventQueue() : head(0), replayed(0), tail(0) {}
+    };
+
+    struct SiteSample
+    {
+        unsigned acquisitions;
+        unsigned cleanStreak;
+        size_t lastSignature;
+    };
+
+    // only the owning thread writes the counters, merging reads them at any time
+    struct WaitProfile
+    {
+        std::atomic<uint64_t> acquisitions;
+        std::atomic<uint64_t> contentions;
+        std::atomic<uint64_t> tryFailures;
+        std::atomic<uint64_t> waitNanoseconds;
+        std::atomic<uint64_t> maxNanoseconds;
+        std::atomic<uint64_t> histogram[ContentionProfile::BUCKETS];
+
+        WaitProfile() : acquisitions(0), contentions(0), tryFailures(0), waitNanoseconds(0), maxNanoseconds(0)
+        {
+            for (auto& bucket : histogram)
+                bucket.store(0, std::memory_order_relaxed);
+        }
+
+        void add(uint64_t nanoseconds, bool contended);
+        void mergeInto(ContentionProfile::Entry& entry) const;
+    };
+
+    // fixed-capacity ring of the newest events, sized once per thread
+    struct LockHistory
+    {
+        CheckerVector<PositionLock> entries;
+        size_t next;
+        size_t count;
+
+        LockHistory() : next(0), count(0) {}
+
+        size_t capacity() const { return entries.size(); }
+        size_t size() const { return count; }
+        bool empty() const { return !count; }
+
+        void resize(size_t depth)
+        {
+            CheckerVector<PositionLock> newEntries(depth);
+            size_t n = count < depth ? count : depth;
+            for (size_t i = 0; i < n; ++i)
+                newEntries[n - 1 - i] = newest(i);
+
+            entries.swap(newEntries);
+            count = n;
+            next = n == depth ? 0 : n;
+        }
+
+        void push(const PositionLock& pos)
+        {
+            entries[next] = pos;
+            if (++next == entries.size())
+                next = 0;
+            if (count < entries.size())
+                ++count;
+        }
+
+        // 0 is the newest event
+        const PositionLock& newest(size_t i) const
+        {
+            size_t index = next + entries.size() - 1 - i;
+            if (index >= entries.size())
+                index -= entries.size();
+            return entries[index];
+        }
+
+        const PositionLock& back() const { return newest(0); }
+
+        void clear()
+        {
+            next = 0;
+            count = 0;
+        }
+    };
+
+    // an edge of the order graph, lock class before first, taken before after
+    struct OrderKey
+    {
+        void* before;
+        void* after;
+
+        bool operator==(const OrderKey& other) const { return before == other.before && after == other.after; }
+        friend size_t flatHashOf(const OrderKey& key) { return flatHashOf(key.before) ^ (flatHashOf(key.after) * 31); }
+    };
+
     struct LockPath
     {
         struct Count
         {
             int c[4];
+            void* lockClass;
+            int64_t since;              // first acquisition, only while hold tracking is on
+            const SourceSite* site;
         };
 
-        std::list<PositionLock> path;
-        std::map<void*, Count> count;
+        ThreadID threadID;
+        unsigned threadIndex;
+        LockHistory path;
+        CheckerMap<void*, Count> count;
+
+        // stripes of the locks in count, a check takes them along with the wanted one
+        uint64_t heldStripes;
+        unsigned stripeHeld[LOCK_STRIPE_COUNT];
+
+        // cleared when the thread exits, the next thread given the same index reuses the path
+        bool isLive;
+
+        // live when checking was enabled again, so it may hold locks taken while
+        // disabled. Only such a thread's unrecorded unlocks of locks missing from
+        // the table are excused, the flag goes with the thread
+        bool isEnabledLate;
+
+        // set by the owning thread around a blocking lock call, read by the watchdog
+        std::atomic<void*> waitingOn;
+        std::atomic<int64_t> waitingSince;
+        std::atomic<int> waitingFlag;
+
+        // written only by the owning thread, read by others under this mutex
+        std::mutex mutex;
+
+        EventQueue events;
+
+        // sampling state is per thread so deciding to skip a check needs no lock
+        CheckerMap<const SourceSite*, SiteSample> samples;
+        std::atomic<size_t> checkedCount;
+        std::atomic<size_t> skippedCount;
+
+        // order edges this thread already found in the graph, a nested acquisition
+        // only takes the order mutex for edges missing here. Dropped whenever the
+        // graph loses edges, which bumps the order generation
+        CheckerMap<OrderKey, bool> knownOrder;
+        size_t knownOrderGeneration;
+
+        // looked up by the owning thread without locking, new entries are inserted under the mutex
+        CheckerMap<const SourceSite*, std::unique_ptr<WaitProfile>> siteProfiles;
+        CheckerMap<void*, std::unique_ptr<WaitProfile>> lockProfiles;
+        CheckerMap<const SourceSite*, std::unique_ptr<WaitProfile>> holdProfiles;
+
+        // timestamp of the event the analyzer replays, 0 when the thread records its own
+        int64_t replayTime;
+
+        LockPath() : heldStripes(0), stripeHeld(), isLive(false), isEnabledLate(false), waitingOn(NULL), waitingSince(0),
+            waitingFlag(0), checkedCount(0), skippedCount(0), knownOrderGeneration(0), replayTime(0) {}
+    };
+
+    typedef std::unique_ptr<std::unique_ptr<LockPath>[]> LockPathChunk;
+
+    // thread-local, releases the thread's path when the thread exits
+    struct ThreadExit
+    {
+        ~ThreadExit();
+    };
+
+    // one slice of the lock table, chosen by the address hash
+    struct LockStripe
+    {
+        std::mutex mutex;
+        CheckerMap<void*, Lock> locks;
+        size_t idleLockCount;
+
+        // the site a lock was first taken at, its class when classed by site. Kept
+        // across sweeps until removeLock, so the class does not move to later sites
+        CheckerMap<void*, const SourceSite*> firstSites;
+
+        // only written while holding the mutex
+        std::atomic<size_t> acquisitions;
+        std::atomic<size_t> contentions;
+
+        // address class order nodes and tags of locks in this stripe, written under
+        // the order and the class mutex, so removeLock can skip both mutexes
+        std::atomic<size_t> orderNodeCount;
+        std::atomic<size_t> taggedCount;
+        char padding[64];
+
+        LockStripe() : idleLockCount(0), acquisitions(0), contentions(0), orderNodeCount(0), taggedCount(0) {}
+    };
+
+    // takes the stripes in ascending order, so overlapping checks never wait on each other in a cycle
+    class StripeGuard
+    {
+    public:
+        StripeGuard(DeadlockChecker& checker, uint64_t mask) : m_checker(checker), m_mask(mask)
+        {
+            m_checker.lockStripes(m_mask);
+        }
+
+        ~StripeGuard()
+        {
+            m_checker.unlockStripes(m_mask);
+        }
+
+    private:
+        DeadlockChecker& m_checker;
+        uint64_t m_mask;
+    };
+
+    struct OrderEdge
+    {
+        const SourceSite* site;
+    };
+
+    struct OrderNode
+    {
+        std::string name;
+        CheckerHashMap<void*, OrderEdge> after;
+        CheckerHashMap<void*, bool> before;     // the reverse edges, to drop a node
     };
 
 public:
+    typedef std::function<void(const DeadlockReport& report)> ReportCallback;
+
     static void init();
     static DeadlockChecker* share();
     static void release();
 
+    // while disabled the macros call the mutex directly. Enabling again drops
+    // what was recorded before, a thread that was checked before may then unlock
+    // a lock the checker does not know unchecked. Threads that first use the
+    // checker after enabling are checked strictly.
+    static void setEnabled(bool enabled);
+    static bool isEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+    static bool isProfiling() { return s_profiling.load(std::memory_order_relaxed) && isEnabled(); }
+
+    // the blocking macros hold one around the real lock call, so the watchdog
+    // sees which lock the thread is blocked on and the profiler how long it waited
+    class WaitScope
+    {
+    public:
+        WaitScope(void* p, const SourceSite* site) : m_path(NULL), m_p(p), m_site(site), m_start(0)
+        {
+            if ((s_watching.load(std::memory_order_relaxed) || s_profiling.load(std::memory_order_relaxed))
+                    && isEnabled())
+                share()->beginWait(*this);
+        }
+
+        ~WaitScope()
+        {
+            if (m_path)
+                share()->endWait(*this);
+        }
+
+    private:
+        friend class DeadlockChecker;
+
+        LockPath* m_path;
+        void* m_p;
+        const SourceSite* m_site;
+        int64_t m_start;
+    };
+
     void lock();
     void unlock();
 
-    bool checkLock(void* p, const char *filename, int line, std::string& err);
-    bool checkTryLock(void* p, const char *filename, int line, std::string& err);
-    bool checkRecursiveLock(void* p, const char *filename, int line, std::string& err);
-    bool checkRecursiveTryLock(void* p, const char *filename, int line, std::string& err);
+    // an acquisition against the recorded order is reported once per pair of
+    // classes through the report callback (or stderr), and still goes ahead.
+    // removeLock (or DEADLOCK_CHECK_DESTROY) forgets a destroyed lock, so a reused
+    // address starts without edges
+    void setLockOrderCheck(bool enabled);
+    bool isLockOrderCheckEnabled();
+    void removeLock(void* p);
+
+    // grows the lock table for lockCount locks and the calling thread's table
+    // for heldCount held locks up front. allocationCount() is the number of heap
+    // blocks the checker took for its bookkeeping, flat once every lock is known
+    void reserve(size_t lockCount, size_t heldCount);
+    static size_t allocationCount();
+
+    void setHistoryDepth(size_t depth);
+    size_t historyDepth();
+
+    // in async mode the check macros only queue events and always succeed, an
+    // analyzer thread replays them in timestamp order and passes conflicts to the
+    // report callback (or stderr). Switch modes while no checked lock is held.
+    void setAsyncMode(bool async);
+    bool isAsyncMode();
+    // also receives the report of a thread that exits while holding locks
+    void setReportCallback(const ReportCallback& callback);
+    size_t asyncStalls();
+
+    // every intervalMs a watchdog thread builds the waits-for graph from the
+    // locks threads are blocked on and the holder tables. It reports cycles of
+    // any length, and waits longer than stallMs (0 disables) even if the holder
+    // is blocked elsewhere, through the report callback. It never stops the
+    // application threads, in async mode it sees holders as late as the analyzer
+    void setWatchdog(bool enabled, unsigned intervalMs = 100, unsigned stallMs = 0);
+    bool isWatchdogEnabled();
+
+    // times every blocking acquisition and counts try-lock failures per site and
+    // per lock, in per-thread profiles the application threads update without
+    // locking. An acquisition that waited contendedNanoseconds or more counts as
+    // contended. contentionProfile() merges the live and the exited threads
+    void setProfiling(bool enabled, unsigned contendedNanoseconds = 1000);
+    ContentionProfile contentionProfile();
+    void profileTry(void* p, const SourceSite* site, bool acquired);
+
+    // times every lock from its first acquisition to the unlock that releases it
+    // on that thread, per site in the same way. A hold of thresholdMicroseconds or
+    // more (0 disables) is reported through the report callback when it ends
+    void setHoldTracking(bool enabled, unsigned thresholdMicroseconds = 0);
+    HoldProfile holdProfile();
+
+    // check one in sampleRate acquisitions per site, and skip a site once it
+    // produced cleanOrderLimit clean checks with the same held set (0 disables).
+    // Held locks are always recorded, skipped acquisitions only miss the analysis.
+    void setSampling(unsigned sampleRate, unsigned cleanOrderLimit);
+    size_t checkedCount();
+    size_t skippedCount();
+
+    // the lock table is split in stripes by address, a check only waits for
+    // the stripes of the wanted lock and of the locks the thread holds
+    std::vector<StripeStats> stripeStats();
+
+    void setLockClassMode(LockClassMode mode);
+    LockClassMode lockClassMode();
+    void setLockClass(void* p, const char* tag);
+
+    // the macros accept either a DeadlockReport or a std::string as the error argument
+    bool checkLock(void* p, const SourceSite* site, DeadlockReport& report);
+    bool checkRecursiveLock(void* p, const SourceSite* site, DeadlockReport& report);
+    bool checkUnlock(void* p, const SourceSite* site, DeadlockReport& report);
+
+    bool checkReadLock(void* p, const SourceSite* site, DeadlockReport& report);
+    bool checkRecursiveReadLock(void* p, const SourceSite* site, DeadlockReport& report);
+    bool checkReadUnlock(void* p, const SourceSite* site, DeadlockReport& report);
+
+    bool checkWriteLock(void* p, const SourceSite* site, DeadlockReport& report);
+    bool checkRecursiveWriteLock(void* p, const SourceSite* site, DeadlockReport& report);
+    bool checkWriteUnlock(void* p, const SourceSite* site, DeadlockReport& report);
+
+    // records a try-lock that already succeeded, the mode comes from the site kind.
+    // It never waited so it is not analysed, a mismatch is reported but the lock is still tracked
+    bool checkTryLock(void* p, const SourceSite* site, DeadlockReport& report);
+
+    // the upgradeable lock is tracked as a recursive read lock, an upgrade as
+    // giving up that read and asking for the write lock, a downgrade the other way round
+    bool checkUpgradeableLock(void* p, const SourceSite* site, DeadlockReport& report);
+    bool checkUpgrade(void* p, const SourceSite* site, DeadlockReport& report);
+    bool checkDowngrade(void* p, const SourceSite* site, DeadlockReport& report);
+
+    // entry points of the CheckedMutex wrappers, which always go on with the real call.
+    // The mode comes from the site kind, a failed check goes to the report callback
+    // and the acquisition is still tracked so the matching unlock stays valid
+    void lockChecked(void* p, const SourceSite* site);
+    void tryLockChecked(void* p, const SourceSite* site, bool acquired);
+    void unlockChecked(void* p, const SourceSite* site);
+
+    // called by LeveledMutex, works without init() and reports on stderr then
+    static void reportLevelInversion(void* p, unsigned level, void* held, unsigned heldLevel);
+
+    bool checkLock(void* p, const SourceSite* site, std::string& err);
+    bool checkRecursiveLock(void* p, const SourceSite* site, std::string& err);
+    bool checkUnlock(void* p, const SourceSite* site, std::string& err);
+
+    bool checkReadLock(void* p, const SourceSite* site, std::string& err);
+    bool checkRecursiveReadLock(void* p, const SourceSite* site, std::string& err);
+    bool checkReadUnlock(void* p, const SourceSite* site, std::string& err);
+
+    bool checkWriteLock(void* p, const SourceSite* site, std::string& err);
+    bool checkRecursiveWriteLock(void* p, const SourceSite* site, std::string& err);
+    bool checkWriteUnlock(void* p, const SourceSite* site, std::string& err);
+
+    bool checkTryLock(void* p, const SourceSite* site, std::string& err);
+
+    bool checkUpgradeableLock(void* p, const SourceSite* site, std::string& err);
+    bool checkUpgrade(void* p, const SourceSite* site, std::string& err);
+    bool checkDowngrade(void* p, const SourceSite* site, std::string& err);
+
+    bool checkLock(void* p, const char *filename, int line, std::string& err, const std::type_info* type = NULL);
+    bool checkTryLock(void* p, const char *filename, int line, std::string& err, const std::type_info* type = NULL);
+    bool checkRecursiveLock(void* p, const char *filename, int line, std::string& err, const std::type_info* type = NULL);
+    bool checkRecursiveTryLock(void* p, const char *filename, int line, std::string& err, const std::type_info* type = NULL);
     bool checkUnlock(void* p, const char *filename, int line, std::string& err);
 
-    bool checkReadLock(void* p, const char *filename, int line, std::string& err);
-    bool checkRecursiveReadLock(void* p, const char *filename, int line, std::string& err);
+    bool checkReadLock(void* p, const char *filename, int line, std::string& err, const std::type_info* type = NULL);
+    bool checkRecursiveReadLock(void* p, const char *filename, int line, std::string& err, const std::type_info* type = NULL);
     bool checkReadUnlock(void* p, const char *filename, int line, std::string& err);
 
-    bool checkWriteLock(void* p, const char *filename, int line, std::string& err);
-    bool checkRecursiveWriteLock(void* p, const char *filename, int line, std::string& err);
+    bool checkWriteLock(void* p, const char *filename, int line, std::string& err, const std::type_info* type = NULL);
+    bool checkRecursiveWriteLock(void* p, const char *filename, int line, std::string& err, const std::type_info* type = NULL);
     bool checkWriteUnlock(void* p, const char *filename, int line, std::string& err);
 
 
 private:
-    inline Lock& getLock(void* p, bool isRecursive, bool isReadWriteLock, const char *filename, int line);
+    inline Lock& getLock(void* p, bool isRecursive, bool isReadWriteLock, const SourceSite* site);
     inline Lock& getLock(void* p);
+    void sweepIdleLocks(LockStripe& stripe);
+
+    static inline unsigned stripeOf(void* p);
+    static inline uint64_t stripeBit(void* p);
+    static inline bool hasOtherHolder(const Lock& lock, unsigned threadIndex);
+    void lockStripes(uint64_t mask);
+    void unlockStripes(uint64_t mask);
+    void resetTracking();
+    bool isUntracked(void* p);
 
-    ThreadID getCurrentThreadID();
-    LockPath& getLockPath(ThreadID threadID);
+    inline LockPath* findLockPath(unsigned threadIndex);
+    inline LockPath& getLockPath(unsigned threadIndex);
+    LockPath& getCurrentLockPath();
+    void releaseLockPath(LockPath& path);
+    void deliverReport(const DeadlockReport& report);
+
+    void beginWait(WaitScope& wait);
+    void endWait(WaitScope& wait);
+    template<class K> static WaitProfile& profileOf(LockPath& path,
+                CheckerMap<K, std::unique_ptr<WaitProfile>>& profiles, K key);
+    void retireProfiles(LockPath& path);
+    void recordHold(LockPath& path, void* p, const SourceSite* site, int64_t nanoseconds);
+    void runWatchdog();
+    typedef std::set<std::pair<unsigned, int64_t>> WaitKeys;    // thread index and wait start
+    void scanWaits(unsigned stallMs, WaitKeys& suspects, WaitKeys& cycles, WaitKeys& stalls);
+    void snapshotWaiting(LockPath& path, DeadlockReport::ThreadState& state, int64_t now);
     inline bool isIntersect(const LockPath& path, void* p, int flagLock, const LockPath& path2);
 
-    std::string stringOfDeadlock(void *p,  const char *filename, int line,
-                ThreadID threadID1, const LockPath& path1,
-                ThreadID threadID2, const LockPath& path2);
-    std::string stringOfDeadlock(ThreadID threadID, const LockPath& path);
+    void reportDeadlock(DeadlockReport& report, void* p, const SourceSite* site,
+                const LockPath& path1, const LockPath& path2);
+    void collectLocks(DeadlockReport& report);
+    void reportError(DeadlockReport& report, DeadlockReport::Kind kind, void* p, const SourceSite* site);
+    void reportOrderInversion(DeadlockReport& report, void* p, const SourceSite* site, void* held,
+                const std::vector<std::pair<void*, void*>>& cycle, const LockPath& path);
+    static void snapshotOf(const LockPath& path, DeadlockReport::ThreadState& state);
+    static bool formatReport(bool ret, const DeadlockReport& report, std::string& err);
+
+    static std::string stringOfSite(const SourceSite* site);
+    static std::string stringOfThread(const DeadlockReport::ThreadState& state);
 
-    std::string stringOfError(const char *err, const char *filename, int line);
+    const SourceSite* internSite(const char *filename, int line, int kind, const std::type_info* type);
+    void* classOfLock(void* p, const SourceSite* site);
+    std::string nameOfLockClass(void* lockClass);
 
-    inline void record(ThreadID threadID, void* p, const char *filename, int line, std::map<ThreadID, int>& counter, LockPath& path, int flagLock);
+    bool findOrderPath(void* from, void* to, std::vector<std::pair<void*, void*>>& edges);
+    bool checkLockOrder(const Lock& lock, const SourceSite* site, LockPath& path, DeadlockReport& report);
+    OrderNode& orderNodeOf(void* lockClass);
+    void dropOrderNode(void* p);
 
-    bool doCheckLock(void* p, const char *filename, int line, std::string& err, int flagLock, bool isRecursive);
-    bool doCheckUnlock(void* p, const char *filename, int line, std::string& err, int flagLock);
+    void pushEvent(void* p, const SourceSite* site, int flagLock, bool isRecursive, bool isLockAction);
+    void runAnalyzer();
+    bool drainEvents();
+    bool shouldCheck(void* p, const SourceSite* site, LockPath& path, SiteSample*& sample, size_t& signature);
+    void forceRecord(void* p, const SourceSite* site, int flagLock, bool isRecursive, LockPath& path);
 
-    bool doCheckLock(void* p, const char *filename, int line, std::string& err, int flagLock, bool isRecursive, ThreadID currentthreadID);
-    bool doCheckUnlock(void* p, const char *filename, int line, std::string& err, int flagLock, ThreadID currentthreadID);
+    inline void addHistory(LockPath& path, const PositionLock& pos);
+    inline void record(const Lock& lock, const SourceSite* site, LockPath& path, int flagLock);
+
+    bool doCheckLock(void* p, const SourceSite* site, DeadlockReport& report, int flagLock, bool isRecursive);
+    bool doCheckUnlock(void* p, const SourceSite* site, DeadlockReport& report, int flagLock);
+
+    bool doCheckLock(void* p, const SourceSite* site, DeadlockReport& report, int flagLock, bool isRecursive, LockPath& currentLockPath);
+    bool doCheckUnlock(void* p, const SourceSite* site, DeadlockReport& report, int flagLock, LockPath& currentLockPath);
+    bool doRecordTryLock(void* p, const SourceSite* site, DeadlockReport& report, int flagLock, bool isRecursive,
+                LockPath& currentLockPath);
 
 private:
     DeadlockChecker();
     ~DeadlockChecker();
 
 private:
-    std::map<void*, Lock> m_locks;
-    std::map<ThreadID, LockPath> m_lockPath;
+    LockStripe m_stripes[LOCK_STRIPE_COUNT];
+
+    // chunks never move, so holders are resolved to their path without m_mutex
+    LockPathChunk m_lockPath[LOCK_PATH_CHUNKS];
+    unsigned m_lockPathCount;
 
+    // guards the thread registry and the switches, never taken while holding a stripe
     std::recursive_mutex m_mutex;
+    unsigned m_generation;
+
+    CheckerHashMap<void*, OrderNode> m_orderGraph;
+    CheckerMap<OrderKey, bool> m_reportedInversions;
+    std::mutex m_orderMutex;
+    std::atomic<bool> m_lockOrderCheck;
+    std::atomic<size_t> m_orderGeneration;
+
+    LockClassMode m_lockClassMode;
+    std::atomic<size_t> m_historyDepth;
+
+    std::atomic<unsigned> m_sampleRate;
+    std::atomic<unsigned> m_cleanOrderLimit;
+
+    std::thread m_watchdog;
+    bool m_watchdogStop;
+    unsigned m_watchdogInterval;
+    unsigned m_watchdogStall;
+    std::mutex m_watchdogMutex;
+    std::condition_variable m_watchdogCondition;
+
+    std::atomic<unsigned> m_profileContended;
+    std::unordered_map<const SourceSite*, ContentionProfile::Entry> m_retiredSites;
+    std::unordered_map<void*, ContentionProfile::Entry> m_retiredLocks;
+    std::unordered_map<const SourceSite*, ContentionProfile::Entry> m_retiredHolds;
+    std::mutex m_profileMutex;  // taken before any path mutex
+
+    std::atomic<bool> m_holdTracking;
+    std::atomic<unsigned> m_holdThreshold;
+
+    std::atomic<bool> m_asyncMode;
+    std::atomic<size_t> m_asyncStalls;
+    std::thread m_analyzer;
+    bool m_analyzerStop;
+    std::mutex m_analyzerMutex;
+    std::condition_variable m_analyzerCondition;
+    ReportCallback m_reportCallback;
+    std::vector<LockPath*> m_analyzerPaths;
+    std::vector<std::pair<LockEvent, LockPath*>> m_analyzerBatch;
+    std::vector<size_t> m_analyzerTails;
+    std::unordered_map<void*, const std::string*> m_lockTags;
+    std::set<std::string> m_lockTagNames;
+    std::unordered_map<void*, std::string> m_lockClassNames;
+    std::mutex m_classMutex;
+
+    std::map<std::tuple<std::string, int, int, const std::type_info*>, SourceSite> m_internedSites;
+    std::mutex m_siteMutex;
 
     static DeadlockChecker* s_this;
+    static unsigned s_generation;
+    static std::atomic<bool> s_enabled;
+    static std::atomic<bool> s_watching;
+    static std::atomic<bool> s_profiling;
 };
 
 #ifdef ENABLE_DEADLOCK_CHECK
 
+#define DEADLOCK_CHECK_SITE(__mutex, __kind) \
+    static const DeadlockChecker::SourceSite __site = {__FILE__, __LINE__, __func__, __kind, &typeid(__mutex)};
+
+// before a lock used through the macros is destroyed, so that a new lock at the
+// same address starts without its order edges, class and history
+#define DEADLOCK_CHECK_DESTROY(__mutex) \
+    ({\
+        if (DeadlockChecker::share())\
+            DeadlockChecker::share()->removeLock(&(__mutex));\
+    })\
+
 #define DEADLOCK_CHECK_LOCK(__mutex, __func, __err) \
     ({\
-        bool ret = DeadlockChecker::share()->checkLock(&(__mutex), __FILE__, __LINE__, __err);\
-        if (ret)\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_LOCK)\
+        bool ret = true;\
+        if (!DeadlockChecker::isEnabled())\
+            (__mutex).__func();\
+        else if ((ret = DeadlockChecker::share()->checkLock(&(__mutex), &__site, __err)))\
+        {\
+            DeadlockChecker::WaitScope wait(&(__mutex), &__site);\
             (__mutex).__func();\
+        }\
         ret;\
     })\
 
 #define DEADLOCK_CHECK_TRY_LOCK(__mutex, __func, __err) \
     ({\
-        DeadlockChecker::share()->lock();\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_LOCK | DeadlockChecker::SITE_TRY)\
         bool ret = (__mutex).__func();\
-        if (ret)\
+        if (DeadlockChecker::isEnabled())\
         {\
-            bool success = DeadlockChecker::share()->checkLock(&(__mutex), __FILE__, __LINE__, __err);\
-            assert(success);\
+            if (ret)\
+                DeadlockChecker::share()->checkTryLock(&(__mutex), &__site, __err);\
+            if (DeadlockChecker::isProfiling())\
+                DeadlockChecker::share()->profileTry(&(__mutex), &__site, ret);\
         }\
-        DeadlockChecker::share()->unlock();\
         ret;\
     })\
 
 #define DEADLOCK_CHECK_RECURSIVE_LOCK(__mutex, __func, __err) \
     ({\
-        bool ret = DeadlockChecker::share()->checkRecursiveLock(&(__mutex), __FILE__, __LINE__, __err);\
-        if (ret)\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_RECURSIVE)\
+        bool ret = true;\
+        if (!DeadlockChecker::isEnabled())\
             (__mutex).__func();\
+        else if ((ret = DeadlockChecker::share()->checkRecursiveLock(&(__mutex), &__site, __err)))\
+        {\
+            DeadlockChecker::WaitScope wait(&(__mutex), &__site);\
+            (__mutex).__func();\
+        }\
         ret;\
     })\
 
 #define DEADLOCK_CHECK_RECURSIVE_TRY_LOCK(__mutex, __func, __err) \
     ({\
-        DeadlockChecker::share()->lock();\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_RECURSIVE | DeadlockChecker::SITE_TRY)\
         bool ret = (__mutex).__func();\
-        if (ret)\
+        if (DeadlockChecker::isEnabled())\
         {\
-            bool success = DeadlockChecker::share()->checkRecursiveLock(&(__mutex), __FILE__, __LINE__, __err);\
-            assert(success);\
+            if (ret)\
+                DeadlockChecker::share()->checkTryLock(&(__mutex), &__site, __err);\
+            if (DeadlockChecker::isProfiling())\
+                DeadlockChecker::share()->profileTry(&(__mutex), &__site, ret);\
         }\
-        DeadlockChecker::share()->unlock();\
         ret;\
     })\
 
 #define DEADLOCK_CHECK_UNLOCK(__mutex, __func, __err) \
     ({\
-        bool ret = DeadlockChecker::share()->checkUnlock(&(__mutex), __FILE__, __LINE__, __err);\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_UNLOCK)\
+        bool ret = !DeadlockChecker::isEnabled() || DeadlockChecker::share()->checkUnlock(&(__mutex), &__site, __err);\
         if (ret)\
             (__mutex).__func();\
         ret;\
@@ -177,49 +841,64 @@ private:
 
 #define DEADLOCK_CHECK_READ_LOCK(__mutex, __func, __err) \
     ({\
-        bool ret = DeadlockChecker::share()->checkReadLock(&(__mutex), __FILE__, __LINE__, __err);\
-        if (ret)\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_READ)\
+        bool ret = true;\
+        if (!DeadlockChecker::isEnabled())\
+            (__mutex).__func();\
+        else if ((ret = DeadlockChecker::share()->checkReadLock(&(__mutex), &__site, __err)))\
+        {\
+            DeadlockChecker::WaitScope wait(&(__mutex), &__site);\
             (__mutex).__func();\
+        }\
         ret;\
     })\
 
 #define DEADLOCK_CHECK_TRY_READ_LOCK(__mutex, __func, __err) \
     ({\
-        DeadlockChecker::share()->lock();\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_READ | DeadlockChecker::SITE_TRY)\
         bool ret = (__mutex).__func();\
-        if (ret)\
+        if (DeadlockChecker::isEnabled())\
         {\
-            bool success = DeadlockChecker::share()->checkReadLock(&(__mutex), __FILE__, __LINE__, __err);\
-            assert(success);\
+            if (ret)\
+                DeadlockChecker::share()->checkTryLock(&(__mutex), &__site, __err);\
+            if (DeadlockChecker::isProfiling())\
+                DeadlockChecker::share()->profileTry(&(__mutex), &__site, ret);\
         }\
-        DeadlockChecker::share()->unlock();\
         ret;\
     })\
 
 #define DEADLOCK_CHECK_RECURSIVE_READ_LOCK(__mutex, __func, __err) \
     ({\
-        bool ret = DeadlockChecker::share()->checkRecursiveReadLock(&(__mutex), __FILE__, __LINE__, __err);\
-        if (ret)\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_READ | DeadlockChecker::SITE_RECURSIVE)\
+        bool ret = true;\
+        if (!DeadlockChecker::isEnabled())\
+            (__mutex).__func();\
+        else if ((ret = DeadlockChecker::share()->checkRecursiveReadLock(&(__mutex), &__site, __err)))\
+        {\
+            DeadlockChecker::WaitScope wait(&(__mutex), &__site);\
             (__mutex).__func();\
+        }\
         ret;\
     })\
 
 #define DEADLOCK_CHECK_RECURSIVE_TRY_READ_LOCK(__mutex, __func, __err) \
     ({\
-        DeadlockChecker::share()->lock();\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_READ | DeadlockChecker::SITE_RECURSIVE | DeadlockChecker::SITE_TRY)\
         bool ret = (__mutex).__func();\
-        if (ret)\
+        if (DeadlockChecker::isEnabled())\
         {\
-            bool success = DeadlockChecker::share()->checkRecursiveReadLock(&(__mutex), __FILE__, __LINE__, __err);\
-            assert(success);\
+            if (ret)\
+                DeadlockChecker::share()->checkTryLock(&(__mutex), &__site, __err);\
+            if (DeadlockChecker::isProfiling())\
+                DeadlockChecker::share()->profileTry(&(__mutex), &__site, ret);\
         }\
-        DeadlockChecker::share()->unlock();\
         ret;\
     })\
 
 #define DEADLOCK_CHECK_READ_UNLOCK(__mutex, __func, __err) \
     ({\
-        bool ret = DeadlockChecker::share()->checkReadUnlock(&(__mutex), __FILE__, __LINE__, __err);\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_READ | DeadlockChecker::SITE_UNLOCK)\
+        bool ret = !DeadlockChecker::isEnabled() || DeadlockChecker::share()->checkReadUnlock(&(__mutex), &__site, __err);\
         if (ret)\
             (__mutex).__func();\
         ret;\
@@ -228,49 +907,101 @@ private:
 
 #define DEADLOCK_CHECK_WRITE_LOCK(__mutex, __func, __err) \
     ({\
-        bool ret = DeadlockChecker::share()->checkWriteLock(&(__mutex), __FILE__, __LINE__, __err);\
-        if (ret)\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_WRITE)\
+        bool ret = true;\
+        if (!DeadlockChecker::isEnabled())\
             (__mutex).__func();\
+        else if ((ret = DeadlockChecker::share()->checkWriteLock(&(__mutex), &__site, __err)))\
+        {\
+            DeadlockChecker::WaitScope wait(&(__mutex), &__site);\
+            (__mutex).__func();\
+        }\
         ret;\
     })\
 
 #define DEADLOCK_CHECK_TRY_WRITE_LOCK(__mutex, __func, __err) \
     ({\
-        DeadlockChecker::share()->lock();\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_WRITE | DeadlockChecker::SITE_TRY)\
         bool ret = (__mutex).__func();\
-        if (ret)\
+        if (DeadlockChecker::isEnabled())\
         {\
-            bool success = DeadlockChecker::share()->checkWriteLock(&(__mutex), __FILE__, __LINE__, __err);\
-            assert(success);\
+            if (ret)\
+                DeadlockChecker::share()->checkTryLock(&(__mutex), &__site, __err);\
+            if (DeadlockChecker::isProfiling())\
+                DeadlockChecker::share()->profileTry(&(__mutex), &__site, ret);\
         }\
-        DeadlockChecker::share()->unlock();\
         ret;\
     })\
 
 #define DEADLOCK_CHECK_RECURSIVE_WRITE_LOCK(__mutex, __func, __err) \
     ({\
-        bool ret = DeadlockChecker::share()->checkRecursiveWriteLock(&(__mutex), __FILE__, __LINE__, __err);\
-        if (ret)\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_WRITE | DeadlockChecker::SITE_RECURSIVE)\
+        bool ret = true;\
+        if (!DeadlockChecker::isEnabled())\
+            (__mutex).__func();\
+        else if ((ret = DeadlockChecker::share()->checkRecursiveWriteLock(&(__mutex), &__site, __err)))\
+        {\
+            DeadlockChecker::WaitScope wait(&(__mutex), &__site);\
             (__mutex).__func();\
+        }\
         ret;\
     })\
 
 #define DEADLOCK_CHECK_RECURSIVE_TRY_WRITE_LOCK(__mutex, __func, __err) \
     ({\
-        DeadlockChecker::share()->lock();\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_WRITE | DeadlockChecker::SITE_RECURSIVE | DeadlockChecker::SITE_TRY)\
         bool ret = (__mutex).__func();\
-        if (ret)\
+        if (DeadlockChecker::isEnabled())\
         {\
-            bool success = DeadlockChecker::share()->checkRecursiveWriteLock(&(__mutex), __FILE__, __LINE__, __err);\
-            assert(success);\
+            if (ret)\
+                DeadlockChecker::share()->checkTryLock(&(__mutex), &__site, __err);\
+            if (DeadlockChecker::isProfiling())\
+                DeadlockChecker::share()->profileTry(&(__mutex), &__site, ret);\
         }\
-        DeadlockChecker::share()->unlock();\
         ret;\
     })\
 
 #define DEADLOCK_CHECK_WRITE_UNLOCK(__mutex, __func, __err) \
     ({\
-        bool ret = DeadlockChecker::share()->checkWriteUnlock(&(__mutex), __FILE__, __LINE__, __err);\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_WRITE | DeadlockChecker::SITE_UNLOCK)\
+        bool ret = !DeadlockChecker::isEnabled() || DeadlockChecker::share()->checkWriteUnlock(&(__mutex), &__site, __err);\
+        if (ret)\
+            (__mutex).__func();\
+        ret;\
+    })\
+
+#define DEADLOCK_CHECK_UPGRADEABLE_LOCK(__mutex, __func, __err) \
+    ({\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_READ | DeadlockChecker::SITE_RECURSIVE | DeadlockChecker::SITE_UPGRADE)\
+        bool ret = true;\
+        if (!DeadlockChecker::isEnabled())\
+            (__mutex).__func();\
+        else if ((ret = DeadlockChecker::share()->checkUpgradeableLock(&(__mutex), &__site, __err)))\
+        {\
+            DeadlockChecker::WaitScope wait(&(__mutex), &__site);\
+            (__mutex).__func();\
+        }\
+        ret;\
+    })\
+
+#define DEADLOCK_CHECK_UPGRADE(__mutex, __func, __err) \
+    ({\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_WRITE | DeadlockChecker::SITE_UPGRADE)\
+        bool ret = true;\
+        if (!DeadlockChecker::isEnabled())\
+            (__mutex).__func();\
+        else if ((ret = DeadlockChecker::share()->checkUpgrade(&(__mutex), &__site, __err)))\
+        {\
+            DeadlockChecker::WaitScope wait(&(__mutex), &__site);\
+            (__mutex).__func();\
+        }\
+        ret;\
+    })\
+
+#define DEADLOCK_CHECK_DOWNGRADE(__mutex, __func, __err) \
+    ({\
+        DEADLOCK_CHECK_SITE(__mutex, DeadlockChecker::SITE_READ | DeadlockChecker::SITE_DOWNGRADE)\
+        bool ret = !DeadlockChecker::isEnabled() || DeadlockChecker::share()->checkDowngrade(&(__mutex), &__site, __err);\
         if (ret)\
             (__mutex).__func();\
         ret;\
@@ -289,6 +1020,7 @@ private:
         ret;\
     })\
 
+#define DEADLOCK_CHECK_DESTROY(__mutex)     ((void)0)
 #define DEADLOCK_CHECK_LOCK(__mutex, __func, __err)         DIRECT_LOCK(__mutex, __func, __err)
 #define DEADLOCK_CHECK_TRY_LOCK(__mutex, __func, __err)         DIRECT_TRY_LOCK(__mutex, __func, __err)
 #define DEADLOCK_CHECK_RECURSIVE_LOCK(__mutex, __func, __err)       DIRECT_LOCK(__mutex, __func, __err)
@@ -307,5 +1039,9 @@ private:
 #define DEADLOCK_CHECK_RECURSIVE_WRITE_LOCK(__mutex, __func, __err)         DIRECT_LOCK(__mutex, __func, __err)
 #define DEADLOCK_CHECK_RECURSIVE_TRY_WRITE_LOCK(__mutex, __func, __err)         DIRECT_TRY_LOCK(__mutex, __func, __err)
 #define DEADLOCK_CHECK_WRITE_UNLOCK(__mutex, __func, __err)         DIRECT_LOCK(__mutex, __func, __err)
+
+#define DEADLOCK_CHECK_UPGRADEABLE_LOCK(__mutex, __func, __err)         DIRECT_LOCK(__mutex, __func, __err)
+#define DEADLOCK_CHECK_UPGRADE(__mutex, __func, __err)      DIRECT_LOCK(__mutex, __func, __err)
+#define DEADLOCK_CHECK_DOWNGRADE(__mutex, __func, __err)        DIRECT_LOCK(__mutex, __func, __err)
 #endif
 #endif // DEADLOCKCHECKER_H
@@ -0,0 +1,215 @@
+#ifndef FLATHASHMAP_H
+#define FLATHASHMAP_H
+
+#include <vector>
+#include <memory>
+#include <utility>
+#include <stdint.h>
+#include <stddef.h>
+
+inline size_t flatHashOf(uint64_t v)
+{
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdULL;
+    v ^= v >> 33;
+    return (size_t)v;
+}
+
+inline size_t flatHashOf(const void* p)
+{
+    return flatHashOf((uint64_t)(uintptr_t)p);
+}
+
+// Open addressing with linear probing. Erase shifts the following entries
+// back instead of leaving tombstones, and slots are only allocated when the
+// table grows, so a steady insert/erase pattern never touches the heap.
+template<class K, class V, class Alloc = std::allocator<std::pair<K, V>>>
+class FlatHashMap
+{
+public:
+    typedef std::pair<K, V> value_type;
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<unsigned char> UsedAlloc;
+
+    template<class Map, class Value>
+    class Iterator
+    {
+    public:
+        Iterator(Map* map, size_t index) : m_map(map), m_index(index) { skip(); }
+
+        Value& operator*() const { return m_map->m_slots[m_index]; }
+        Value* operator->() const { return &m_map->m_slots[m_index]; }
+
+        Iterator& operator++()
+        {
+            ++m_index;
+            skip();
+            return *this;
+        }
+
+        bool operator==(const Iterator& other) const { return m_index == other.m_index; }
+        bool operator!=(const Iterator& other) const { return m_index != other.m_index; }
+
+    private:
+        void skip()
+        {
+            while (m_index < m_map->m_used.size() && !m_map->m_used[m_index])
+                ++m_index;
+        }
+
+    private:
+        Map* m_map;
+        size_t m_index;
+
+        friend class FlatHashMap;
+    };
+
+    typedef Iterator<FlatHashMap, value_type> iterator;
+    typedef Iterator<const FlatHashMap, const value_type> const_iterator;
+
+public:
+    FlatHashMap() : m_size(0) {}
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, m_used.size()); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, m_used.size()); }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return !m_size; }
+    size_t capacity() const { return m_slots.size(); }
+
+    // true if the next insert of a new key has to grow the table
+    bool full() const { return (m_size + 1) * 4 > m_slots.size() * 3; }
+
+    iterator find(const K& key) { return iterator(this, indexOf(key)); }
+    const_iterator find(const K& key) const { return const_iterator(this, indexOf(key)); }
+    size_t count(const K& key) const { return indexOf(key) != m_used.size(); }
+
+    std::pair<iterator, bool> insert(value_type value)
+    {
+        if (full())
+            rehash(m_slots.empty() ? 8 : m_slots.size() * 2);
+
+        size_t mask = m_slots.size() - 1;
+        size_t i = flatHashOf(value.first) & mask;
+        for (; m_used[i]; i = (i + 1) & mask)
+        {
+            if (m_slots[i].first == value.first)
+                return std::make_pair(iterator(this, i), false);
+        }
+
+        m_slots[i] = std::move(value);
+        m_used[i] = 1;
+        ++m_size;
+        return std::make_pair(iterator(this, i), true);
+    }
+
+    V& operator[](const K& key)
+    {
+        size_t i = indexOf(key);
+        if (i != m_used.size())
+            return m_slots[i].second;
+
+        return insert(value_type(key, V())).first->second;
+    }
+
+    void erase(iterator it)
+    {
+        size_t i = it.m_index;
+        size_t mask = m_slots.size() - 1;
+
+        m_slots[i].second = V();
+        m_used[i] = 0;
+        --m_size;
+
+        for (size_t j = (i + 1) & mask; m_used[j]; j = (j + 1) & mask)
+        {
+            size_t home = flatHashOf(m_slots[j].first) & mask;
+            bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+            if (stays)
+                continue;
+
+            m_slots[i] = std::move(m_slots[j]);
+            m_used[i] = 1;
+            m_used[j] = 0;
+            i = j;
+        }
+    }
+
+    size_t erase(const K& key)
+    {
+        iterator it = find(key);
+        if (it == end())
+            return 0;
+
+        erase(it);
+        return 1;
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < m_used.size(); ++i)
+        {
+            if (m_used[i])
+                m_slots[i].second = V();
+            m_used[i] = 0;
+        }
+        m_size = 0;
+    }
+
+    void reserve(size_t n)
+    {
+        size_t capacity = 8;
+        while (capacity * 3 < n * 4)
+            capacity *= 2;
+
+        if (capacity > m_slots.size())
+            rehash(capacity);
+    }
+
+private:
+    size_t indexOf(const K& key) const
+    {
+        if (m_slots.empty())
+            return m_used.size();
+
+        size_t mask = m_slots.size() - 1;
+        for (size_t i = flatHashOf(key) & mask; m_used[i]; i = (i + 1) & mask)
+        {
+            if (m_slots[i].first == key)
+                return i;
+        }
+
+        return m_used.size();
+    }
+
+    void rehash(size_t capacity)
+    {
+        std::vector<value_type, Alloc> slots(capacity);
+        std::vector<unsigned char, UsedAlloc> used(capacity, 0);
+        size_t mask = capacity - 1;
+
+        for (size_t i = 0; i < m_slots.size(); ++i)
+        {
+            if (!m_used[i])
+                continue;
+
+            size_t j = flatHashOf(m_slots[i].first) & mask;
+            while (used[j])
+                j = (j + 1) & mask;
+
+            slots[j] = std::move(m_slots[i]);
+            used[j] = 1;
+        }
+
+        m_slots.swap(slots);
+        m_used.swap(used);
+    }
+
+private:
+    std::vector<value_type, Alloc> m_slots;
+    std::vector<unsigned char, UsedAlloc> m_used;
+    size_t m_size;
+};
+
+#endif // FLATHASHMAP_H
@@ -0,0 +1,128 @@
+#ifndef HOLDERSET_H
+#define HOLDERSET_H
+
+#include <string.h>
+#include "CheckerAllocator.h"
+
+// Threads currently holding one lock. A lock is almost always held by one
+// writer or a few readers, so the first holders live inline and only heavily
+// shared read locks move to a heap array.
+class HolderSet
+{
+public:
+    struct Holder
+    {
+        unsigned thread;      // ThreadIdentity index
+        unsigned exclusive;   // plain or write acquisitions
+        unsigned shared;      // read acquisitions
+    };
+
+    HolderSet() : m_heap(NULL), m_size(0), m_capacity(INLINE_CAPACITY) {}
+    ~HolderSet() { delete[] m_heap; }
+
+    HolderSet(HolderSet&& other) : m_heap(NULL), m_size(0), m_capacity(INLINE_CAPACITY)
+    {
+        take(other);
+    }
+
+    HolderSet& operator=(HolderSet&& other)
+    {
+        if (this != &other)
+        {
+            delete[] m_heap;
+            m_heap = NULL;
+            m_capacity = INLINE_CAPACITY;
+            take(other);
+        }
+
+        return *this;
+    }
+
+    HolderSet(const HolderSet&) = delete;
+    HolderSet& operator=(const HolderSet&) = delete;
+
+    Holder* begin() { return data(); }
+    Holder* end() { return data() + m_size; }
+    const Holder* begin() const { return data(); }
+    const Holder* end() const { return data() + m_size; }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return !m_size; }
+
+    Holder* find(unsigned thread)
+    {
+        for (Holder* holder = begin(); holder != end(); ++holder)
+        {
+            if (holder->thread == thread)
+                return holder;
+        }
+
+        return NULL;
+    }
+
+    // the holder entry of thread, added with zero counts if missing
+    Holder& get(unsigned thread)
+    {
+        Holder* holder = find(thread);
+        if (holder)
+            return *holder;
+
+        if (m_size == m_capacity)
+            grow();
+
+        holder = data() + m_size++;
+        holder->thread = thread;
+        holder->exclusive = 0;
+        holder->shared = 0;
+        return *holder;
+    }
+
+    void erase(Holder* holder)
+    {
+        *holder = data()[--m_size];
+    }
+
+    void clear() { m_size = 0; }
+
+private:
+    enum { INLINE_CAPACITY = 2 };
+
+    Holder* data() { return m_heap ? m_heap : m_inline; }
+    const Holder* data() const { return m_heap ? m_heap : m_inline; }
+
+    void grow()
+    {
+        CheckerAllocations::add();
+        Holder* heap = new Holder[m_capacity * 2];
+        memcpy(heap, data(), m_size * sizeof(Holder));
+        delete[] m_heap;
+        m_heap = heap;
+        m_capacity *= 2;
+    }
+
+    void take(HolderSet& other)
+    {
+        if (other.m_heap)
+        {
+            m_heap = other.m_heap;
+            m_capacity = other.m_capacity;
+            other.m_heap = NULL;
+            other.m_capacity = INLINE_CAPACITY;
+        }
+        else
+        {
+            memcpy(m_inline, other.m_inline, other.m_size * sizeof(Holder));
+        }
+
+        m_size = other.m_size;
+        other.m_size = 0;
+    }
+
+private:
+    Holder m_inline[INLINE_CAPACITY];
+    Holder* m_heap;
+    unsigned m_size;
+    unsigned m_capacity;
+};
+
+#endif // HOLDERSET_H
@@ -0,0 +1,130 @@
+#ifndef LOCKHIERARCHY_H
+#define LOCKHIERARCHY_H
+
+#include <stdint.h>
+#include <type_traits>
+#include "DeadlockChecker.h"
+
+// Locks with a fixed place in the lock order. A thread may only take a lock
+// whose level is above every level it holds, so a second lock of a held level
+// is an inversion too. Nested LevelGuards check that at compile time, every
+// other acquisition (try-locks included) with one shift of the thread's held
+// level mask. They bypass the path analysis of the checker, and stay on
+// without ENABLE_DEADLOCK_CHECK. An inversion goes to the report callback of
+// the checker (or stderr) and the lock is still taken.
+class LockLevels
+{
+public:
+    enum { MAX_LEVEL = 63 };
+
+    // bit n set while the thread holds a lock of level n
+    static uint64_t& held()
+    {
+        static thread_local uint64_t held = 0;
+        return held;
+    }
+
+    // locks of each level the thread holds, a bit clears when its count drops to zero
+    static unsigned& count(unsigned level)
+    {
+        static thread_local unsigned counts[MAX_LEVEL + 1] = {};
+        return counts[level];
+    }
+
+    // the last lock taken at each level, for the reports
+    static void*& holder(unsigned level)
+    {
+        static thread_local void* holders[MAX_LEVEL + 1] = {};
+        return holders[level];
+    }
+};
+
+template<class M, unsigned Level>
+class LeveledMutex
+{
+    static_assert(Level <= LockLevels::MAX_LEVEL, "lock levels go from 0 to 63");
+
+public:
+    static const unsigned LEVEL = Level;
+
+    LeveledMutex() {}
+    LeveledMutex(const LeveledMutex&) = delete;
+    LeveledMutex& operator=(const LeveledMutex&) = delete;
+
+    void lock()
+    {
+        checkLevel();
+        m_mutex.lock();
+        takeLevel();
+    }
+
+    bool try_lock()
+    {
+        if (!m_mutex.try_lock())
+            return false;
+
+        // this try cannot wait, but the same order with a lock() elsewhere can
+        checkLevel();
+        takeLevel();
+        return true;
+    }
+
+    void unlock()
+    {
+        if (!--LockLevels::count(Level))
+        {
+            LockLevels::holder(Level) = NULL;
+            LockLevels::held() &= ~((uint64_t)1 << Level);
+        }
+        m_mutex.unlock();
+    }
+
+    M& native() { return m_mutex; }
+
+private:
+    void checkLevel()
+    {
+        uint64_t held = LockLevels::held();
+        if (held >> Level)
+        {
+            unsigned heldLevel = Level;
+            while (heldLevel < LockLevels::MAX_LEVEL && (held >> (heldLevel + 1)))
+                ++heldLevel;
+            DeadlockChecker::reportLevelInversion(this, Level, LockLevels::holder(heldLevel), heldLevel);
+        }
+    }
+
+    void takeLevel()
+    {
+        ++LockLevels::count(Level);
+        LockLevels::holder(Level) = this;
+        LockLevels::held() |= (uint64_t)1 << Level;
+    }
+
+private:
+    M m_mutex;
+};
+
+// only nests inside a guard of a lower level, any other order does not compile
+template<class M>
+class LevelGuard
+{
+public:
+    explicit LevelGuard(M& mutex) : m_mutex(mutex) { m_mutex.lock(); }
+
+    template<class Outer, class = typename std::enable_if<(Outer::LEVEL < M::LEVEL)>::type>
+    LevelGuard(M& mutex, const LevelGuard<Outer>&) : m_mutex(mutex)
+    {
+        m_mutex.lock();
+    }
+
+    ~LevelGuard() { m_mutex.unlock(); }
+
+    LevelGuard(const LevelGuard&) = delete;
+    LevelGuard& operator=(const LevelGuard&) = delete;
+
+private:
+    M& m_mutex;
+};
+
+#endif // LOCKHIERARCHY_H
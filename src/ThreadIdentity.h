@@ -0,0 +1,95 @@
+#ifndef THREADIDENTITY_H
+#define THREADIDENTITY_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#if defined(_WIN32) || defined(_WIN64)
+    #include <processthreadsapi.h>
+#else
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+// Identity of the calling thread, asked from the system once per thread.
+// Indexes are small and go back to a free list when their thread exits, so
+// per-thread tables can be plain arrays that stay as large as the most
+// threads alive at once.
+class ThreadIdentity
+{
+public:
+#if defined(_WIN32) || defined(_WIN64)
+    typedef DWORD ThreadID;
+#else
+    typedef __pid_t ThreadID;
+#endif
+
+    static ThreadID currentID() { return current().id; }
+    static unsigned currentIndex() { return current().index; }
+
+    // one above the highest index handed out so far
+    static unsigned count() { return registry().count.load(); }
+
+private:
+    struct Identity
+    {
+        ThreadID id;
+        unsigned index;
+
+        Identity() : id(systemThreadID()), index(acquireIndex()) {}
+        ~Identity() { releaseIndex(index); }
+    };
+
+    struct Registry
+    {
+        std::mutex mutex;
+        std::vector<unsigned> freeIndexes;
+        std::atomic<unsigned> count;
+
+        Registry() : count(0) {}
+    };
+
+    static const Identity& current()
+    {
+        static thread_local Identity identity;
+        return identity;
+    }
+
+    // never destroyed, threads may still exit after static destruction began
+    static Registry& registry()
+    {
+        static Registry* registry = new Registry();
+        return *registry;
+    }
+
+    static unsigned acquireIndex()
+    {
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> guard(reg.mutex);
+        if (reg.freeIndexes.empty())
+            return reg.count++;
+
+        unsigned index = reg.freeIndexes.back();
+        reg.freeIndexes.pop_back();
+        return index;
+    }
+
+    static void releaseIndex(unsigned index)
+    {
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> guard(reg.mutex);
+        reg.freeIndexes.push_back(index);
+    }
+
+    static ThreadID systemThreadID()
+    {
+#if defined(_WIN32) || defined(_WIN64)
+        return GetCurrentThreadId();
+#else
+        return syscall(SYS_gettid);
+#endif
+    }
+};
+
+#endif // THREADIDENTITY_H
@@ -1,8 +1,13 @@
 #include <QCoreApplication>
 #include <mutex>
 #include "src/DeadlockChecker.h"
+#include "src/CheckedMutex.h"
+#include "src/LockHierarchy.h"
 #include "ReadWriteLock.h"
 #include <functional>
+#include <vector>
+#include <thread>
+#include <chrono>
 
 #define TEST(_expression, _expect, _err) \
 {\
@@ -385,17 +390,1150 @@ bool test8()
     return false;
 }
 
+bool test9()
+{
+    std::string err;
+    static std::mutex m1, m2;
+    std::vector<DeadlockChecker::DeadlockReport> reports;
+
+    DeadlockChecker::share()->setReportCallback([&](const DeadlockChecker::DeadlockReport& report)
+    {
+        reports.push_back(report);
+    });
+    DeadlockChecker::share()->setLockOrderCheck(true);
+
+    bool ret = false;
+    do
+    {
+        TEST3(DEADLOCK_CHECK_LOCK(m1, lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_LOCK(m2, lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(m2, unlock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(m1, unlock, err), err, ret);
+
+        // reported, but the lock is still taken, and only reported once
+        for (int i = 0; i < 2; ++i)
+        {
+            TEST3(DEADLOCK_CHECK_LOCK(m2, lock, err), err, ret);
+            TEST3(DEADLOCK_CHECK_LOCK(m1, lock, err), err, ret);
+            TEST3(DEADLOCK_CHECK_UNLOCK(m1, unlock, err), err, ret);
+            TEST3(DEADLOCK_CHECK_UNLOCK(m2, unlock, err), err, ret);
+        }
+        ret = true;
+    } while (0);
+
+    DeadlockChecker::share()->setLockOrderCheck(false);
+    DeadlockChecker::share()->setReportCallback(nullptr);
+
+    for (auto& report : reports)
+        printf("%s\n", report.toString().c_str());
+
+    if (reports.size() != 1 || reports[0].kind != DeadlockChecker::DeadlockReport::REPORT_ORDER_INVERSION
+            || reports[0].p != &m1 || reports[0].held != &m2)
+    {
+        printf("failed. %d reports\n", (int)reports.size());
+        return false;
+    }
+
+    return ret;
+}
+
+bool test10()
+{
+    std::string err;
+    static std::mutex connections[2], caches[2];
+    std::vector<DeadlockChecker::DeadlockReport> reports;
+
+    DeadlockChecker::share()->setReportCallback([&](const DeadlockChecker::DeadlockReport& report)
+    {
+        reports.push_back(report);
+    });
+    DeadlockChecker::share()->setLockOrderCheck(true);
+    DeadlockChecker::share()->setLockClassMode(DeadlockChecker::LOCK_CLASS_BY_TAG);
+    for (int i = 0; i < 2; ++i)
+    {
+        DeadlockChecker::share()->setLockClass(&connections[i], "connection");
+        DeadlockChecker::share()->setLockClass(&caches[i], "cache");
+    }
+
+    bool ret = false;
+    do
+    {
+        TEST3(DEADLOCK_CHECK_LOCK(connections[0], lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_LOCK(caches[0], lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(caches[0], unlock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(connections[0], unlock, err), err, ret);
+
+        TEST3(DEADLOCK_CHECK_LOCK(caches[1], lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_LOCK(connections[1], lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(connections[1], unlock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(caches[1], unlock, err), err, ret);
+        ret = true;
+    } while (0);
+
+    DeadlockChecker::share()->setLockOrderCheck(false);
+    DeadlockChecker::share()->setLockClassMode(DeadlockChecker::LOCK_CLASS_BY_ADDRESS);
+    DeadlockChecker::share()->setReportCallback(nullptr);
+    for (int i = 0; i < 2; ++i)
+    {
+        DeadlockChecker::share()->removeLock(&connections[i]);
+        DeadlockChecker::share()->removeLock(&caches[i]);
+    }
+
+    for (auto& report : reports)
+        printf("%s\n", report.toString().c_str());
+
+    if (reports.size() != 1 || reports[0].p != &connections[1])
+    {
+        printf("failed. inversion between classes not reported\n");
+        return false;
+    }
+
+    return ret;
+}
+
+bool test11()
+{
+    std::string err;
+    static std::mutex m1, m2;
+    std::vector<std::string> reports;
+
+    DeadlockChecker::share()->setReportCallback([&](const DeadlockChecker::DeadlockReport& report)
+    {
+        reports.push_back(report.toString());
+    });
+    DeadlockChecker::share()->setLockOrderCheck(true);
+    DeadlockChecker::share()->setAsyncMode(true);
+
+    bool ret = false;
+    do
+    {
+        TEST3(DEADLOCK_CHECK_LOCK(m1, lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_LOCK(m2, lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(m2, unlock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(m1, unlock, err), err, ret);
+
+        TEST3(DEADLOCK_CHECK_LOCK(m2, lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_LOCK(m1, lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(m1, unlock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(m2, unlock, err), err, ret);
+        ret = true;
+    } while (0);
+
+    DeadlockChecker::share()->setAsyncMode(false);
+    DeadlockChecker::share()->setLockOrderCheck(false);
+    DeadlockChecker::share()->setReportCallback(nullptr);
+    DeadlockChecker::share()->removeLock(&m1);
+    DeadlockChecker::share()->removeLock(&m2);
+
+    for (auto& report : reports)
+        printf("%s\n", report.c_str());
+
+    if (reports.size() != 1)
+    {
+        printf("failed. %d reports\n", (int)reports.size());
+        return false;
+    }
+
+    return ret;
+}
+
+bool test12()
+{
+    std::string err;
+    static std::mutex m1;
+
+    DeadlockChecker::share()->setSampling(4, 0);
+    size_t skipped = DeadlockChecker::share()->skippedCount();
+
+    bool ret = false;
+    do
+    {
+        int i = 0;
+        for (; i < 8; ++i)
+        {
+            TEST3(DEADLOCK_CHECK_LOCK(m1, lock, err), err, ret);
+            TEST3(DEADLOCK_CHECK_UNLOCK(m1, unlock, err), err, ret);
+        }
+        if (i == 8)
+            ret = true;
+    } while (0);
+
+    skipped = DeadlockChecker::share()->skippedCount() - skipped;
+    DeadlockChecker::share()->setSampling(1, 0);
+    DeadlockChecker::share()->removeLock(&m1);
+
+    if (skipped != 6)
+    {
+        printf("failed. %d checks skipped\n", (int)skipped);
+        return false;
+    }
+
+    return ret;
+}
+
+bool test13()
+{
+    DeadlockChecker::DeadlockReport report;
+    static std::mutex m1;
+
+    bool ret = false;
+    do
+    {
+        if (!DEADLOCK_CHECK_LOCK(m1, lock, report))
+        {
+            printf("failed. %s\n", report.toString().c_str());
+            break;
+        }
+
+        if (DEADLOCK_CHECK_RECURSIVE_LOCK(m1, lock, report))
+        {
+            printf("failed. mismatched check not reported\n");
+        }
+        else
+        {
+            std::string json = report.toJson();
+            printf("%s\n", json.c_str());
+            ret = report.kind == DeadlockChecker::DeadlockReport::REPORT_FUNC_NOT_MATCHING
+                    && json.find("{\"kind\":\"func-not-matching\"") == 0;
+        }
+        DEADLOCK_CHECK_UNLOCK(m1, unlock, report);
+    } while (0);
+
+    DeadlockChecker::share()->removeLock(&m1);
+
+    return ret;
+}
+
+bool test14()
+{
+    std::string err;
+    static std::mutex m1, m2;
+
+    bool ret = false;
+    do
+    {
+        DeadlockChecker::setEnabled(false);
+        TEST3(DEADLOCK_CHECK_LOCK(m1, lock, err), err, ret);
+        DeadlockChecker::setEnabled(true);
+
+        TEST3(DEADLOCK_CHECK_LOCK(m2, lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(m2, unlock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(m1, unlock, err), err, ret);
+
+        std::string err2;
+        if (DeadlockChecker::share()->checkUnlock(&m2, __FILE__, __LINE__, err2))
+        {
+            printf("failed. invalid unlock not reported\n");
+            break;
+        }
+        printf("%s\n", err2.c_str());
+
+        // a thread started after enabling cannot hold such locks, even once
+        // m2 is swept from the table its unlock is reported
+        static std::mutex fillers[2000];
+        bool filled = true;
+        for (auto& filler : fillers)
+            filled = filled && DEADLOCK_CHECK_LOCK(filler, lock, err) && DEADLOCK_CHECK_UNLOCK(filler, unlock, err);
+        TEST3(filled, err, ret);
+
+        bool reported = false;
+        std::thread t([&]()
+        {
+            std::string err3;
+            reported = !DeadlockChecker::share()->checkUnlock(&m2, __FILE__, __LINE__, err3);
+        });
+        t.join();
+        if (!reported)
+        {
+            printf("failed. invalid unlock on a new thread not reported\n");
+            break;
+        }
+        ret = true;
+    } while (0);
+
+    DeadlockChecker::share()->removeLock(&m1);
+    DeadlockChecker::share()->removeLock(&m2);
+
+    return ret;
+}
+
+bool test15()
+{
+    DistributedReadWriteLock m1;
+    std::string err;
+
+    TEST (DEADLOCK_CHECK_READ_LOCK(m1, readLock, err), true, err);
+
+
+    TEST (DEADLOCK_CHECK_TRY_WRITE_LOCK(m1, tryWriteLock, err), false, err);
+
+
+    TEST (DEADLOCK_CHECK_READ_UNLOCK(m1, readUnlock, err), true, err);
+
+
+    TEST (DEADLOCK_CHECK_TRY_WRITE_LOCK(m1, tryWriteLock, err), true, err);
+
+
+    TEST (DEADLOCK_CHECK_TRY_READ_LOCK(m1, tryReadLock, err), false, err);
+
+
+    TEST (DEADLOCK_CHECK_WRITE_UNLOCK(m1, writeUnlock, err), true, err);
+
+
+    TEST (DEADLOCK_CHECK_READ_LOCK(m1, readLock, err), true, err);
+
+
+    TEST (DEADLOCK_CHECK_READ_UNLOCK(m1, readUnlock, err), true, err);
+
+    // the slots keep their cache lines on the heap too
+    std::unique_ptr<DistributedReadWriteLock> m2(new DistributedReadWriteLock);
+    std::unique_ptr<DistributedReadWriteLock[]> m3(new DistributedReadWriteLock[3]);
+    if ((uintptr_t)m2.get() % alignof(DistributedReadWriteLock) || (uintptr_t)m3.get() % alignof(DistributedReadWriteLock))
+    {
+        printf("failed. misaligned heap lock\n");
+        return false;
+    }
+    TEST (DEADLOCK_CHECK_WRITE_LOCK(*m2, writeLock, err), true, err);
+    TEST (DEADLOCK_CHECK_WRITE_UNLOCK(*m2, writeUnlock, err), true, err);
+
+    return true;
+}
+
+bool test16()
+{
+    RecursiveReadWriteLock m1;
+    std::string err;
+
+    TEST (DEADLOCK_CHECK_UPGRADEABLE_LOCK(m1, upgradeableLock, err), true, err);
+
+
+    TEST (DEADLOCK_CHECK_RECURSIVE_READ_LOCK(m1, readLock, err), true, err);
+
+
+    TEST (DEADLOCK_CHECK_UPGRADE(m1, upgrade, err), false, err);
+
+
+    TEST (DEADLOCK_CHECK_READ_UNLOCK(m1, readUnlock, err), true, err);
+
+
+    TEST (DEADLOCK_CHECK_UPGRADE(m1, upgrade, err), true, err);
+
+
+    TEST (DEADLOCK_CHECK_RECURSIVE_READ_LOCK(m1, readLock, err), true, err);
+
+
+    TEST (DEADLOCK_CHECK_READ_UNLOCK(m1, readUnlock, err), true, err);
+
+
+    TEST (DEADLOCK_CHECK_DOWNGRADE(m1, downgrade, err), true, err);
+
+
+    TEST (DEADLOCK_CHECK_RECURSIVE_TRY_WRITE_LOCK(m1, tryWriteLock, err), false, err);
+
+
+    TEST (DEADLOCK_CHECK_READ_UNLOCK(m1, readUnlock, err), true, err);
+
+    return true;
+}
+
 #define FLAG_DEFAULT   1
 #define FLAG_READ   2
 #define FLAG_WRITE  4
 
+bool test17()
+{
+    std::recursive_mutex m1;
+    std::string err;
+
+    TEST (DEADLOCK_CHECK_LOCK(m1, lock, err), true, err);
+
+    // the try already took the lock, so the mismatch is reported and the lock still tracked
+    TEST (DEADLOCK_CHECK_RECURSIVE_TRY_LOCK(m1, try_lock, err), true, err);
+    if (err.empty())
+    {
+        printf("failed.\n");
+        return false;
+    }
+    printf("%s\n", err.c_str());
+
+
+    TEST (DEADLOCK_CHECK_UNLOCK(m1, unlock, err), true, err);
+    TEST (DEADLOCK_CHECK_UNLOCK(m1, unlock, err), true, err);
+    TEST (DEADLOCK_CHECK_UNLOCK(m1, unlock, err), false, err);
+
+    return true;
+}
+
+bool test18()
+{
+    std::mutex m1, m2;
+    std::string err;
+
+    std::vector<DeadlockChecker::StripeStats> before = DeadlockChecker::share()->stripeStats();
+
+    TEST (DEADLOCK_CHECK_LOCK(m1, lock, err), true, err);
+    TEST (DEADLOCK_CHECK_LOCK(m2, lock, err), true, err);
+    TEST (DEADLOCK_CHECK_UNLOCK(m2, unlock, err), true, err);
+    TEST (DEADLOCK_CHECK_UNLOCK(m1, unlock, err), true, err);
+
+    std::vector<DeadlockChecker::StripeStats> after = DeadlockChecker::share()->stripeStats();
+    size_t acquisitions = 0;
+    for (size_t i = 0; i < after.size(); ++i)
+        acquisitions += after[i].acquisitions - before[i].acquisitions;
+
+    // each check takes at least the stripe of its own lock
+    if (after.size() != before.size() || acquisitions < 4)
+    {
+        printf("failed.\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool test19()
+{
+    std::mutex m1, m2;
+    ReadWriteLock rw;
+    std::string err;
+
+    DeadlockChecker::share()->reserve(64, 8);
+
+    size_t allocations = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+        // the first round creates the entries, after that nothing may allocate
+        if (i == 1)
+            allocations = DeadlockChecker::allocationCount();
+
+        TEST (DEADLOCK_CHECK_LOCK(m1, lock, err), true, err);
+        TEST (DEADLOCK_CHECK_READ_LOCK(rw, readLock, err), true, err);
+        TEST (DEADLOCK_CHECK_LOCK(m2, lock, err), true, err);
+        TEST (DEADLOCK_CHECK_UNLOCK(m2, unlock, err), true, err);
+        TEST (DEADLOCK_CHECK_READ_UNLOCK(rw, readUnlock, err), true, err);
+        TEST (DEADLOCK_CHECK_UNLOCK(m1, unlock, err), true, err);
+    }
+
+    if (DeadlockChecker::allocationCount() != allocations)
+    {
+        printf("%zu allocations in the steady state\n", DeadlockChecker::allocationCount() - allocations);
+        printf("failed.\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool test20()
+{
+    struct NoopLock
+    {
+        void lock() {}
+        void unlock() {}
+    } l;
+
+    std::vector<DeadlockChecker::DeadlockReport> reports;
+    DeadlockChecker::share()->setReportCallback([&](const DeadlockChecker::DeadlockReport& report)
+    {
+        reports.push_back(report);
+    });
+
+    unsigned exitedIndex = 0;
+    std::thread t1([&]()
+    {
+        std::string err;
+        exitedIndex = ThreadIdentity::currentIndex();
+        DEADLOCK_CHECK_LOCK(l, lock, err);
+    });
+    t1.join();
+    DeadlockChecker::share()->setReportCallback(nullptr);
+
+    if (reports.size() != 1 || reports[0].kind != DeadlockChecker::DeadlockReport::REPORT_THREAD_EXIT
+            || reports[0].threads[0].held.size() != 1 || reports[0].threads[0].held[0].p != &l)
+    {
+        printf("failed.\n");
+        return false;
+    }
+    printf("%s\n", reports[0].toString().c_str());
+
+    // the next thread gets the index and a clean path, the dead thread holds nothing
+    bool reused = false;
+    std::thread t2([&]()
+    {
+        std::string err;
+        reused = ThreadIdentity::currentIndex() == exitedIndex
+                && DEADLOCK_CHECK_LOCK(l, lock, err) && DEADLOCK_CHECK_UNLOCK(l, unlock, err);
+        if (!reused)
+            printf("%s\n", err.c_str());
+    });
+    t2.join();
+
+    if (!reused)
+    {
+        printf("failed.\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool test21()
+{
+    // gives up after a while, so the cycle below resolves itself once the watchdog has seen it
+    struct TimedLock
+    {
+        std::timed_mutex m;
+        std::atomic<bool> owned;
+        TimedLock() : owned(false) {}
+        void lock() { owned = m.try_lock_for(std::chrono::milliseconds(500)); }
+        void unlock() { if (owned) { owned = false; m.unlock(); } }
+    } l[3];
+
+    std::mutex reportMutex;
+    std::vector<DeadlockChecker::DeadlockReport> reports;
+    DeadlockChecker::share()->setReportCallback([&](const DeadlockChecker::DeadlockReport& report)
+    {
+        std::lock_guard<std::mutex> reportGuard(reportMutex);
+        reports.push_back(report);
+    });
+    DeadlockChecker::share()->setWatchdog(true, 10, 0);
+
+    std::atomic<int> ready(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 3; ++i)
+    {
+        threads.push_back(std::thread([&, i]()
+        {
+            std::string err;
+            DEADLOCK_CHECK_LOCK(l[i], lock, err);
+            ready++;
+            while (ready < 3)
+                std::this_thread::yield();
+
+            DEADLOCK_CHECK_LOCK(l[(i + 1) % 3], lock, err);
+            DEADLOCK_CHECK_UNLOCK(l[(i + 1) % 3], unlock, err);
+            DEADLOCK_CHECK_UNLOCK(l[i], unlock, err);
+        }));
+    }
+    for (auto& t : threads)
+        t.join();
+
+    bool foundCycle = false;
+    {
+        std::lock_guard<std::mutex> reportGuard(reportMutex);
+        for (auto& report : reports)
+        {
+            if (report.kind == DeadlockChecker::DeadlockReport::REPORT_WAIT_CYCLE && report.threads.size() == 3)
+            {
+                printf("%s\n", report.toString().c_str());
+                foundCycle = true;
+            }
+        }
+        reports.clear();
+    }
+
+    // a wait longer than the stall limit is reported with the thread holding the lock
+    DeadlockChecker::share()->setWatchdog(true, 10, 50);
+    std::mutex m;
+    std::string err;
+    DEADLOCK_CHECK_LOCK(m, lock, err);
+    std::thread t([&]()
+    {
+        std::string err;
+        DEADLOCK_CHECK_LOCK(m, lock, err);
+        DEADLOCK_CHECK_UNLOCK(m, unlock, err);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    DEADLOCK_CHECK_UNLOCK(m, unlock, err);
+    t.join();
+
+    DeadlockChecker::share()->setWatchdog(false);
+    DeadlockChecker::share()->setReportCallback(nullptr);
+
+    bool foundStall = false;
+    for (auto& report : reports)
+    {
+        if (report.kind == DeadlockChecker::DeadlockReport::REPORT_STALL && report.p == &m
+                && report.threads.size() == 2 && report.threads[0].waitingOn == &m)
+        {
+            printf("%s\n", report.toString().c_str());
+            foundStall = true;
+        }
+    }
+
+    if (!foundCycle || !foundStall)
+    {
+        printf("failed.\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool test22()
+{
+    DeadlockChecker::share()->setProfiling(true);
+
+    std::mutex m;
+    std::string err;
+    DEADLOCK_CHECK_LOCK(m, lock, err);
+    std::atomic<bool> tried(false);
+    std::thread t([&]()
+    {
+        std::string err;
+        tried = !DEADLOCK_CHECK_TRY_LOCK(m, try_lock, err);
+        DEADLOCK_CHECK_LOCK(m, lock, err);
+        DEADLOCK_CHECK_UNLOCK(m, unlock, err);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    DEADLOCK_CHECK_UNLOCK(m, unlock, err);
+    t.join();
+
+    DeadlockChecker::share()->setProfiling(false);
+
+    // the waiting thread is gone, its profile was kept
+    DeadlockChecker::ContentionProfile profile = DeadlockChecker::share()->contentionProfile();
+    printf("%s\n", profile.toString(5).c_str());
+
+    bool found = false;
+    for (auto& entry : profile.locks)
+    {
+        if (entry.p == &m)
+            found = entry.acquisitions == 2 && entry.contentions == 1 && entry.tryFailures == 1
+                    && entry.maxNanoseconds >= 20000000;
+    }
+
+    if (!tried || !found || profile.sites.empty() || profile.sites[0].waitNanoseconds < 20000000
+            || profile.sites[0].percentile(1.0) < 20000000)
+    {
+        printf("failed.\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool test23()
+{
+    std::mutex reportMutex;
+    std::vector<DeadlockChecker::DeadlockReport> reports;
+    DeadlockChecker::share()->setReportCallback([&](const DeadlockChecker::DeadlockReport& report)
+    {
+        std::lock_guard<std::mutex> reportGuard(reportMutex);
+        reports.push_back(report);
+    });
+    DeadlockChecker::share()->setHoldTracking(true, 20000);
+
+    std::string err;
+    std::mutex m1, m2;
+    std::recursive_mutex r;
+
+    // only the outermost recursive acquisition counts
+    DEADLOCK_CHECK_RECURSIVE_LOCK(r, lock, err);
+    DEADLOCK_CHECK_LOCK(m1, lock, err);
+    DEADLOCK_CHECK_RECURSIVE_LOCK(r, lock, err);
+    std::this_thread::sleep_for(std::chrono::milliseconds(40));
+    DEADLOCK_CHECK_UNLOCK(r, unlock, err);
+    DEADLOCK_CHECK_UNLOCK(m1, unlock, err);
+    DEADLOCK_CHECK_UNLOCK(r, unlock, err);
+
+    DEADLOCK_CHECK_LOCK(m2, lock, err);
+    DEADLOCK_CHECK_UNLOCK(m2, unlock, err);
+
+    // replayed events keep the time they happened at
+    DeadlockChecker::share()->setAsyncMode(true);
+    DEADLOCK_CHECK_LOCK(m2, lock, err);
+    std::this_thread::sleep_for(std::chrono::milliseconds(40));
+    DEADLOCK_CHECK_UNLOCK(m2, unlock, err);
+    DeadlockChecker::share()->setAsyncMode(false);
+
+    DeadlockChecker::share()->setHoldTracking(false);
+    DeadlockChecker::share()->setReportCallback(nullptr);
+
+    int longHolds = 0;
+    for (auto& report : reports)
+    {
+        if (report.kind == DeadlockChecker::DeadlockReport::REPORT_LONG_HOLD && report.heldMicroseconds >= 30000)
+        {
+            printf("%s\n", report.toString().c_str());
+            longHolds += report.p == &m2 ? 100 : report.p == &m1 || report.p == &r;
+        }
+    }
+
+    DeadlockChecker::HoldProfile profile = DeadlockChecker::share()->holdProfile();
+    printf("%s\n", profile.toString(5).c_str());
+
+    size_t recursiveHolds = 0;
+    for (auto& entry : profile.sites)
+    {
+        if (entry.site->filename == std::string(__FILE__) && entry.site->type == &typeid(r))
+            recursiveHolds += entry.acquisitions;
+    }
+
+    if (longHolds != 102 || recursiveHolds != 1 || profile.sites.size() < 3)
+    {
+        printf("failed.\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool test24()
+{
+    struct NoopLock
+    {
+        void lock() {}
+        bool try_lock() { return true; }
+        void unlock() {}
+    };
+
+    struct SharedLock
+    {
+        ReadWriteLock l;
+        void lock() { l.writeLock(); }
+        bool try_lock() { return l.tryWriteLock(); }
+        void unlock() { l.writeUnlock(); }
+        void lock_shared() { l.readLock(); }
+        bool try_lock_shared() { return l.tryReadLock(); }
+        void unlock_shared() { l.readUnlock(); }
+    };
+    static_assert(sizeof(CheckedSharedMutex<SharedLock>) == sizeof(SharedLock), "no state added");
+
+    std::vector<DeadlockChecker::DeadlockReport> reports;
+    DeadlockChecker::share()->setReportCallback([&](const DeadlockChecker::DeadlockReport& report)
+    {
+        reports.push_back(report);
+    });
+
+    // the standard guards and std::lock only see a Lockable
+    CheckedMutex<std::mutex> m1, m2;
+    CheckedRecursiveMutex<std::recursive_mutex> r;
+    CheckedSharedMutex<SharedLock> s;
+    {
+        std::lock_guard<CheckedMutex<std::mutex>> guard(m1);
+        std::unique_lock<CheckedRecursiveMutex<std::recursive_mutex>> outer(r);
+        std::unique_lock<CheckedRecursiveMutex<std::recursive_mutex>> inner(r);
+    }
+    std::lock(m1, m2);
+    m2.unlock();
+    m1.unlock();
+    {
+        DEADLOCK_CHECK_SHARED_GUARD(reader, s);
+        std::thread t([&]()
+        {
+            DEADLOCK_CHECK_SHARED_GUARD(reader, s);
+        });
+        t.join();
+    }
+    {
+        DEADLOCK_CHECK_GUARD(writer, s);
+    }
+    bool clean = reports.empty();
+
+    // a failed check is reported, the lock is still taken and released in pairs
+    CheckedMutex<NoopLock> n;
+    int line = 0;
+    {
+        DEADLOCK_CHECK_GUARD(first, n);
+        line = __LINE__; DEADLOCK_CHECK_GUARD(second, n);
+    }
+    {
+        DEADLOCK_CHECK_GUARD(again, n);
+    }
+    DeadlockChecker::share()->setReportCallback(nullptr);
+
+    for (auto& report : reports)
+        printf("%s\n", report.toString().c_str());
+
+    if (!clean || reports.size() != 1 || reports[0].kind != DeadlockChecker::DeadlockReport::REPORT_DEADLOCK
+            || reports[0].site->line != line)
+    {
+        printf("failed.\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool test25()
+{
+    typedef LeveledMutex<std::mutex, 1> ConfigMutex;
+    typedef LeveledMutex<std::mutex, 2> CacheMutex;
+    typedef LeveledMutex<std::mutex, 3> ShardMutex;
+
+    // nesting against the hierarchy does not compile
+    static_assert(std::is_constructible<LevelGuard<CacheMutex>, CacheMutex&, const LevelGuard<ConfigMutex>&>::value,
+                  "config < cache");
+    static_assert(!std::is_constructible<LevelGuard<ConfigMutex>, ConfigMutex&, const LevelGuard<CacheMutex>&>::value,
+                  "cache < config");
+
+    std::vector<DeadlockChecker::DeadlockReport> reports;
+    DeadlockChecker::share()->setReportCallback([&](const DeadlockChecker::DeadlockReport& report)
+    {
+        reports.push_back(report);
+    });
+
+    ConfigMutex config;
+    CacheMutex cache;
+    ShardMutex shard;
+    {
+        LevelGuard<ConfigMutex> configGuard(config);
+        LevelGuard<CacheMutex> cacheGuard(cache, configGuard);
+        LevelGuard<ShardMutex> shardGuard(shard, cacheGuard);
+    }
+
+    // released out of order, the levels still come back clean
+    config.lock();
+    shard.lock();
+    config.unlock();
+    shard.unlock();
+    {
+        std::lock_guard<ConfigMutex> configGuard(config);
+        std::lock_guard<CacheMutex> cacheGuard(cache);
+    }
+    bool clean = reports.empty();
+
+    // only known at runtime
+    {
+        std::lock_guard<CacheMutex> cacheGuard(cache);
+        std::lock_guard<ConfigMutex> configGuard(config);
+    }
+    {
+        std::lock_guard<ConfigMutex> configGuard(config);
+    }
+    DeadlockChecker::share()->setReportCallback(nullptr);
+
+    for (auto& report : reports)
+        printf("%s\n", report.toString().c_str());
+
+    if (!clean || reports.size() != 1 || reports[0].kind != DeadlockChecker::DeadlockReport::REPORT_LEVEL_INVERSION
+            || reports[0].p != &config || reports[0].held != &cache || reports[0].heldLevel != 2)
+    {
+        printf("failed.\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool test26()
+{
+    // deeper than the old 16-bit holder counts
+    const int depth = 70000;
+    std::recursive_mutex m1;
+    std::string err;
+
+    for (int i = 0; i < depth; ++i)
+        TEST (DEADLOCK_CHECK_RECURSIVE_LOCK(m1, lock, err), true, err);
+
+    for (int i = 0; i < depth; ++i)
+        TEST (DEADLOCK_CHECK_UNLOCK(m1, unlock, err), true, err);
+
+    TEST (DEADLOCK_CHECK_UNLOCK(m1, unlock, err), false, err);
+
+    return true;
+}
+
+bool test27()
+{
+    typedef LeveledMutex<std::mutex, 1> ConfigMutex;
+    typedef LeveledMutex<std::mutex, 2> CacheMutex;
+
+    std::vector<DeadlockChecker::DeadlockReport> reports;
+    DeadlockChecker::share()->setReportCallback([&](const DeadlockChecker::DeadlockReport& report)
+    {
+        reports.push_back(report);
+    });
+
+    ConfigMutex config;
+    CacheMutex cache1, cache2;
+
+    // a second lock of the same level is reported, and releasing one of them
+    // keeps the level held
+    cache1.lock();
+    cache2.lock();
+    cache1.unlock();
+    config.lock();
+    config.unlock();
+    cache2.unlock();
+    size_t sameLevel = reports.size();
+
+    // a try-lock against the order is reported as well
+    cache1.lock();
+    bool locked = config.try_lock();
+    if (locked)
+        config.unlock();
+    cache1.unlock();
+
+    // and everything is released again
+    config.lock();
+    cache1.lock();
+    cache1.unlock();
+    config.unlock();
+    DeadlockChecker::share()->setReportCallback(nullptr);
+
+    for (auto& report : reports)
+        printf("%s\n", report.toString().c_str());
+
+    if (sameLevel != 2 || !locked || reports.size() != 3 || reports[0].p != &cache2 || reports[0].heldLevel != 2
+            || reports[1].p != &config || reports[2].p != &config || reports[2].held != &cache1)
+    {
+        printf("failed.\n");
+        return false;
+    }
+
+    return true;
+}
+
+static void takeNested(bool reverse)
+{
+    CheckedMutex<std::mutex> first, second;
+    std::lock_guard<CheckedMutex<std::mutex>> outerGuard(reverse ? second : first);
+    std::lock_guard<CheckedMutex<std::mutex>> innerGuard(reverse ? first : second);
+}
+
+bool test28()
+{
+    std::vector<DeadlockChecker::DeadlockReport> reports;
+    DeadlockChecker::share()->setReportCallback([&](const DeadlockChecker::DeadlockReport& report)
+    {
+        reports.push_back(report);
+    });
+    DeadlockChecker::share()->setLockOrderCheck(true);
+
+    // the second call gets the same addresses for new locks, taken the other way round
+    takeNested(false);
+    takeNested(true);
+
+    DeadlockChecker::share()->setLockOrderCheck(false);
+    DeadlockChecker::share()->setReportCallback(nullptr);
+
+    for (auto& report : reports)
+        printf("%s\n", report.toString().c_str());
+
+    if (!reports.empty())
+    {
+        printf("failed. edges of destroyed locks were kept\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool test29()
+{
+    std::string err;
+    static std::mutex m1, m2, fillers[2000];
+    std::vector<DeadlockChecker::DeadlockReport> reports;
+
+    DeadlockChecker::share()->setReportCallback([&](const DeadlockChecker::DeadlockReport& report)
+    {
+        reports.push_back(report);
+    });
+    DeadlockChecker::share()->setLockOrderCheck(true);
+
+    bool ret = false;
+    do
+    {
+        TEST3(DEADLOCK_CHECK_LOCK(m1, lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_LOCK(m2, lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(m2, unlock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(m1, unlock, err), err, ret);
+
+        // enough idle locks to sweep the stripes, the order must survive it
+        bool filled = true;
+        for (auto& filler : fillers)
+            filled = filled && DEADLOCK_CHECK_LOCK(filler, lock, err) && DEADLOCK_CHECK_UNLOCK(filler, unlock, err);
+        TEST3(filled, err, ret);
+
+        TEST3(DEADLOCK_CHECK_LOCK(m2, lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_LOCK(m1, lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(m1, unlock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(m2, unlock, err), err, ret);
+        ret = true;
+    } while (0);
+
+    DeadlockChecker::share()->setLockOrderCheck(false);
+    DeadlockChecker::share()->setReportCallback(nullptr);
+    DeadlockChecker::share()->removeLock(&m1);
+    DeadlockChecker::share()->removeLock(&m2);
+
+    if (reports.size() != 1)
+    {
+        printf("failed. %d reports\n", (int)reports.size());
+        return false;
+    }
+
+    return ret;
+}
+
+bool test30()
+{
+    std::mutex reportsMutex;
+    std::vector<DeadlockChecker::DeadlockReport> reports;
+    DeadlockChecker::share()->setReportCallback([&](const DeadlockChecker::DeadlockReport& report)
+    {
+        std::lock_guard<std::mutex> reportsGuard(reportsMutex);
+        reports.push_back(report);
+    });
+    DeadlockChecker::share()->setAsyncMode(true);
+
+    // an exiting thread's path must not be cleared while its events are still replayed
+    static std::mutex locks[8];
+    for (int round = 0; round < 20; ++round)
+    {
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 8; ++i)
+        {
+            threads.push_back(std::thread([i]()
+            {
+                std::string err;
+                for (int j = 0; j < 3000; ++j)
+                {
+                    DEADLOCK_CHECK_LOCK(locks[i], lock, err);
+                    DEADLOCK_CHECK_UNLOCK(locks[i], unlock, err);
+                }
+            }));
+        }
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    DeadlockChecker::share()->setAsyncMode(false);
+    DeadlockChecker::share()->setReportCallback(nullptr);
+
+    for (auto& report : reports)
+        printf("%s\n", report.toString().c_str());
+
+    if (!reports.empty())
+    {
+        printf("failed. %d reports\n", (int)reports.size());
+        return false;
+    }
+
+    return true;
+}
+
+static bool takeForward(std::mutex& a, std::mutex& b)
+{
+    std::string err;
+    bool ret = false;
+    do
+    {
+        TEST3(DEADLOCK_CHECK_LOCK(a, lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_LOCK(b, lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(b, unlock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(a, unlock, err), err, ret);
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+static bool takeBackward(std::mutex& a, std::mutex& b)
+{
+    std::string err;
+    bool ret = false;
+    do
+    {
+        TEST3(DEADLOCK_CHECK_LOCK(b, lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_LOCK(a, lock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(a, unlock, err), err, ret);
+        TEST3(DEADLOCK_CHECK_UNLOCK(b, unlock, err), err, ret);
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+bool test31()
+{
+    static std::mutex a, b;
+    std::vector<DeadlockChecker::DeadlockReport> reports;
+
+    DeadlockChecker::share()->setReportCallback([&](const DeadlockChecker::DeadlockReport& report)
+    {
+        reports.push_back(report);
+    });
+    DeadlockChecker::share()->setLockOrderCheck(true);
+    DeadlockChecker::share()->setLockClassMode(DeadlockChecker::LOCK_CLASS_BY_SITE);
+
+    // the locks keep the classes of their first sites once idle again
+    bool ret = takeForward(a, b) && takeBackward(a, b);
+
+    DeadlockChecker::share()->setLockOrderCheck(false);
+    DeadlockChecker::share()->setLockClassMode(DeadlockChecker::LOCK_CLASS_BY_ADDRESS);
+    DeadlockChecker::share()->setReportCallback(nullptr);
+    DeadlockChecker::share()->removeLock(&a);
+    DeadlockChecker::share()->removeLock(&b);
+
+    for (auto& report : reports)
+        printf("%s\n", report.toString().c_str());
+
+    if (reports.size() != 1 || reports[0].kind != DeadlockChecker::DeadlockReport::REPORT_ORDER_INVERSION)
+    {
+        printf("failed. %d reports\n", (int)reports.size());
+        return false;
+    }
+
+    return ret;
+}
+
+static void takeRawNested(bool reverse)
+{
+    std::string err;
+    std::mutex first, second;
+    std::mutex& outer = reverse ? second : first;
+    std::mutex& inner = reverse ? first : second;
+
+    DEADLOCK_CHECK_LOCK(outer, lock, err);
+    DEADLOCK_CHECK_LOCK(inner, lock, err);
+    DEADLOCK_CHECK_UNLOCK(inner, unlock, err);
+    DEADLOCK_CHECK_UNLOCK(outer, unlock, err);
+    DEADLOCK_CHECK_DESTROY(first);
+    DEADLOCK_CHECK_DESTROY(second);
+}
+
+bool test32()
+{
+    std::vector<DeadlockChecker::DeadlockReport> reports;
+    DeadlockChecker::share()->setReportCallback([&](const DeadlockChecker::DeadlockReport& report)
+    {
+        reports.push_back(report);
+    });
+    DeadlockChecker::share()->setLockOrderCheck(true);
+
+    // like test28 with plain mutexes destroyed through the macro
+    takeRawNested(false);
+    takeRawNested(true);
+
+    DeadlockChecker::share()->setLockOrderCheck(false);
+    DeadlockChecker::share()->setReportCallback(nullptr);
+
+    for (auto& report : reports)
+        printf("%s\n", report.toString().c_str());
+
+    if (!reports.empty())
+    {
+        printf("failed. edges of destroyed locks were kept\n");
+        return false;
+    }
+
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
     DeadlockChecker::init();
 
     bool allSuccess = true;
-    const int N = 8;
-    std::function<bool()> testFuncs[N] = {test1, test2, test3, test4, test5, test6, test7, test8};
+    const int N = 32;
+    std::function<bool()> testFuncs[N] = {test1, test2, test3, test4, test5, test6, test7, test8, test9, test10,
+                                          test11, test12, test13, test14,
+                                          test15, test16, test17, test18, test19,
+                                          test20, test21, test22, test23, test24,
+                                          test25, test26, test27, test28, test29, test30, test31, test32};
     for (int i = 0; i < N; ++i)
     {
         int index = i + 1;